@@ -0,0 +1,78 @@
+/* ------------------------------------------------------------------------
+   cache_hotset.c
+
+   Replays a hot-set read workload against the buffer cache: READS
+   single sector DiskReads, HOT_PERCENT of them of one of HOT_SECTORS
+   sectors spread over the disk, the rest of any sector. The sequence is
+   the same on every run. Reports time per read and the cache counters.
+
+   Built twice, with BENCH_CACHE set to the default capacity and to 0.
+   Links all four phases; this file is the start4.
+   ------------------------------------------------------------------------ */
+#include <stddef.h>
+#include <processManager.h>
+#include <libuser.h>
+#include "driver.h"
+
+#define READS 2000
+#define HOT_SECTORS 32
+#define HOT_PERCENT 90
+
+extern int cacheCapacity;
+
+static unsigned int seed = 12345;
+
+/* Runs before startup, while the cache can still be sized */
+__attribute__((constructor)) static void configure(void)
+{
+   cacheCapacity = BENCH_CACHE;
+}
+
+/* A small LCG, so no libc is called from user mode */
+static int nextRandom(int range)
+{
+   seed = seed * 1103515245 + 12345;
+   return (seed >> 8) % range;
+}
+
+int start4(char *arg)
+{
+   char buffer[DISK_SECTOR_SIZE];
+   int hot[HOT_SECTORS];
+   diskCacheStats stats;
+   int sectorSize;
+   int trackSize;
+   int tracks;
+   int status;
+   int start;
+   int end;
+
+   DiskSize(0, &sectorSize, &trackSize, &tracks);
+   for (int i = 0; i < HOT_SECTORS; i++)
+   {
+      hot[i] = nextRandom(tracks * trackSize);
+   }
+
+   GetTimeofDay(&start);
+   for (int i = 0; i < READS; i++)
+   {
+      int sector;
+
+      if (nextRandom(100) < HOT_PERCENT)
+         sector = hot[nextRandom(HOT_SECTORS)];
+      else
+         sector = nextRandom(tracks * trackSize);
+
+      DiskRead(buffer, 0, sector / trackSize, sector % trackSize, 1, &status);
+   }
+   GetTimeofDay(&end);
+
+   DiskCacheStats(&stats);
+   console("hot-set replay, cache capacity %d: %d reads, %d%% of them of %d sectors\n",
+           stats.capacity, READS, HOT_PERCENT, HOT_SECTORS);
+   console("  elapsed %d us, %d us per read\n", end - start, (end - start) / READS);
+   console("  hits %d  misses %d  hit ratio %.1f%%  evictions %d\n", stats.hits,
+           stats.misses, stats.hits + stats.misses > 0 ? 100.0 * stats.hits / (stats.hits + stats.misses) : 0.0,
+           stats.evictions);
+   return 0;
+}
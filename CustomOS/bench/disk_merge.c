@@ -0,0 +1,93 @@
+/* ------------------------------------------------------------------------
+   disk_merge.c
+
+   Disk request merging. READERS user procs read ROUNDS times each, all
+   on the round's track, so every round queues READERS requests behind
+   each other. Two patterns are run: adjacent, proc k reading sector k,
+   and overlapping, every proc reading the same OVERLAP_SECTORS sectors.
+   A merged pass still transfers each distinct sector once, so adjacent
+   reads only save driver passes while overlapping ones save device ops.
+   Prints the elapsed time and the driver's counters after each pattern;
+   the counters are cumulative.
+
+   Built twice, with BENCH_MERGING set to 1 and 0. The buffer cache is
+   off so every read reaches the driver. Links all four phases; this file
+   is the start4.
+   ------------------------------------------------------------------------ */
+#include <stddef.h>
+#include <usloss.h>
+#include <libuser.h>
+
+#define READERS 8
+#define ROUNDS 200
+#define OVERLAP_SECTORS 4
+
+extern int cacheCapacity;
+extern int diskMerging;
+extern void dump_disk_stats(void);
+
+/* arg[0] is the pattern, arg[1] the reader's number */
+static char *adjacentIds[READERS] = {"a0", "a1", "a2", "a3", "a4", "a5", "a6", "a7"};
+static char *overlapIds[READERS] = {"o0", "o1", "o2", "o3", "o4", "o5", "o6", "o7"};
+
+/* Runs before startup, while the cache can still be sized */
+__attribute__((constructor)) static void configure(void)
+{
+   cacheCapacity = 0;
+   diskMerging = BENCH_MERGING;
+}
+
+static int reader(char *arg)
+{
+   char buffer[OVERLAP_SECTORS * DISK_SECTOR_SIZE];
+   int overlapping = arg[0] == 'o';
+   int sector = overlapping ? 0 : arg[1] - '0';
+   int sectors = overlapping ? OVERLAP_SECTORS : 1;
+   int sectorSize;
+   int trackSize;
+   int tracks;
+   int status;
+
+   DiskSize(0, &sectorSize, &trackSize, &tracks);
+   for (int round = 0; round < ROUNDS; round++)
+   {
+      if (DiskRead(buffer, 0, (round * 7) % tracks, sector, sectors, &status) != 0 || status != 0)
+      {
+         console("disk_merge: read of sector %d failed\n", sector);
+         Terminate(1);
+      }
+   }
+   return 0;
+}
+
+static void run(char *pattern, char **ids)
+{
+   int status;
+   int start;
+   int end;
+   int pid;
+
+   GetTimeofDay(&start);
+   for (int i = 0; i < READERS; i++)
+   {
+      Spawn("reader", reader, ids[i], USLOSS_MIN_STACK, 3, &pid);
+   }
+   for (int i = 0; i < READERS; i++)
+   {
+      Wait(&pid, &status);
+   }
+   GetTimeofDay(&end);
+
+   console("disk merging %s: %d readers x %d rounds, %s\n",
+           diskMerging ? "on" : "off", READERS, ROUNDS, pattern);
+   console("  elapsed %d us, %d us per read\n", end - start,
+           (end - start) / (READERS * ROUNDS));
+   dump_disk_stats();
+}
+
+int start4(char *arg)
+{
+   run("adjacent sectors", adjacentIds);
+   run("overlapping sectors", overlapIds);
+   return 0;
+}
@@ -0,0 +1,60 @@
+/* ------------------------------------------------------------------------
+   disk_read.c
+
+   Disk read throughput in sectors per second for 1, 16 and 256 sector
+   DiskReads, ROW_SECTORS sectors per row. The buffer cache is turned off
+   and every read starts at track 0 sector 0, so each one goes through
+   the driver to the device. Links all four phases; this file is the
+   start4.
+   ------------------------------------------------------------------------ */
+#include <stddef.h>
+#include <usloss.h>
+#include <libuser.h>
+
+#define ROW_SECTORS 2048
+
+extern int cacheCapacity;
+
+static char buffer[256 * DISK_SECTOR_SIZE];
+
+/* Runs before startup, while the cache can still be sized */
+__attribute__((constructor)) static void configure(void)
+{
+   cacheCapacity = 0;
+}
+
+static void measure(int sectors)
+{
+   int reads = ROW_SECTORS / sectors;
+   int status;
+   int start;
+   int end;
+
+   GetTimeofDay(&start);
+   for (int i = 0; i < reads; i++)
+   {
+      if (DiskRead(buffer, 0, 0, 0, sectors, &status) != 0 || status != 0)
+      {
+         console("disk_read: read of %d sectors failed\n", sectors);
+         Terminate(1);
+      }
+   }
+   GetTimeofDay(&end);
+
+   console("%8d %6d %12d %12.0f\n", sectors, reads, end - start,
+           ROW_SECTORS * 1000000.0 / (end - start));
+}
+
+int start4(char *arg)
+{
+   int sizes[] = {1, 16, 256};
+
+   console("disk read throughput, cache off, %d sectors per row\n", ROW_SECTORS);
+   console(" sectors  reads   elapsed_us  sectors/sec\n");
+   for (int i = 0; i < 3; i++)
+   {
+      measure(sizes[i]);
+   }
+   halt(0);
+   return 0;
+}
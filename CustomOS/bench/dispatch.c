@@ -0,0 +1,95 @@
+/* ------------------------------------------------------------------------
+   dispatch.c
+
+   Dispatch latency of phase 1 with 10, 50 and MAXPROC processes in the
+   table. Two procs at priority 2 hand the CPU back and forth with
+   block_me and unblock_proc while fillers sit ready at priorities 3 to
+   5, so every switch goes through the ready lists with them queued.
+
+   Nothing is joined: each row's pair stays blocked once it is done and
+   its fillers stay ready, and the next row adds to them. The run ends
+   with halt(0). Links phase 1 alone; this file stands in for phase 2.
+   ------------------------------------------------------------------------ */
+#include <stddef.h>
+#include <processManager.h>
+
+#define ROUND_TRIPS 100000
+#define BENCH_BLOCKED 20 // ping and pong
+#define BENCH_WAITING 21 // start1 while a row runs
+
+static int start1Pid;
+static int pingPid;
+static int pongPid;
+static int elapsed;
+static int numProcs = 2; // the sentinel and start1
+
+void p1_fork(int pid) {}
+void p1_switch(int old, int new) {}
+void p1_quit(int pid) {}
+
+static int filler(char *arg)
+{
+   return 0;
+}
+
+static int pong(char *arg)
+{
+   for (int i = 0; i < ROUND_TRIPS; i++)
+   {
+      block_me(BENCH_BLOCKED);
+      unblock_proc(pingPid);
+   }
+   block_me(BENCH_BLOCKED);
+   return 0;
+}
+
+static int ping(char *arg)
+{
+   int start = sys_clock();
+
+   for (int i = 0; i < ROUND_TRIPS; i++)
+   {
+      unblock_proc(pongPid);
+      block_me(BENCH_BLOCKED);
+   }
+   elapsed = sys_clock() - start;
+   unblock_proc(start1Pid);
+   block_me(BENCH_BLOCKED);
+   return 0;
+}
+
+/* Fills the table up to procs with a new pair and times its round trips */
+static void measure(int procs)
+{
+   while (numProcs < procs - 2)
+   {
+      fork1("filler", filler, NULL, USLOSS_MIN_STACK, 3 + numProcs % 3);
+      numProcs++;
+   }
+
+   pongPid = fork1("pong", pong, NULL, USLOSS_MIN_STACK, 2);
+   pingPid = fork1("ping", ping, NULL, USLOSS_MIN_STACK, 2);
+   numProcs += 2;
+   block_me(BENCH_WAITING);
+
+   console("%6d %12d %12.0f\n", procs, elapsed,
+           elapsed * 1000.0 / (2.0 * ROUND_TRIPS));
+}
+
+int start1(char *arg)
+{
+   int levels[] = {10, 50, MAXPROC};
+
+   start1Pid = getpid();
+   console("dispatch latency, %d round trips per row\n", ROUND_TRIPS);
+   console(" procs   elapsed_us    ns/switch\n");
+   for (int i = 0; i < 3; i++)
+   {
+      if (levels[i] <= MAXPROC && levels[i] > numProcs + 2)
+      {
+         measure(levels[i]);
+      }
+   }
+   halt(0);
+   return 0;
+}
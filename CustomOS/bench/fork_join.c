@@ -0,0 +1,61 @@
+/* ------------------------------------------------------------------------
+   fork_join.c
+
+   fork1/join pairs per second, and the resident set size of the whole
+   program before and after SPAWNS of them. Stack sizes cycle through 1,
+   2 and 4 times USLOSS_MIN_STACK so every size class of the stack pool
+   gets reused. Links phase 1 alone; this file stands in for phase 2.
+   ------------------------------------------------------------------------ */
+#include <stdio.h>
+#include <unistd.h>
+#include <processManager.h>
+
+#define SPAWNS 100000
+
+void p1_fork(int pid) {}
+void p1_switch(int old, int new) {}
+void p1_quit(int pid) {}
+
+static int child(char *arg)
+{
+   return 0;
+}
+
+/* Resident set size in KB, from /proc */
+static long rssKB(void)
+{
+   long pages = 0;
+   long resident = 0;
+   FILE *statm = fopen("/proc/self/statm", "r");
+
+   if (statm != NULL)
+   {
+      if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+      {
+         resident = 0;
+      }
+      fclose(statm);
+   }
+   return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+int start1(char *arg)
+{
+   int status;
+   long rssBefore = rssKB();
+   int start = sys_clock();
+   int elapsed;
+
+   for (int i = 0; i < SPAWNS; i++)
+   {
+      fork1("child", child, NULL, (1 << (i % 3)) * USLOSS_MIN_STACK, 2);
+      join(&status);
+   }
+   elapsed = sys_clock() - start;
+
+   console("%d fork1/join pairs in %d us, %.0f pairs/sec\n", SPAWNS, elapsed,
+           SPAWNS * 1000000.0 / elapsed);
+   console("rss before %ld KB, after %ld KB\n", rssBefore, rssKB());
+   halt(0);
+   return 0;
+}
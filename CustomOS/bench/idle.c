@@ -0,0 +1,79 @@
+/* ------------------------------------------------------------------------
+   idle.c
+
+   Interrupts per second while the system is idle, with the clock
+   tickless or ticking every CLOCK_TICK. Two idle patterns: start4 alone
+   asleep for IDLE_US, and SLEEPERS procs that wake every PERIOD_US for
+   the same time and go straight back to sleep. The counts are the clock
+   and disk interrupts host/usloss.c took; nothing touches the disk, so
+   they are all clock interrupts. The clock driver's own counters are
+   printed at the end.
+
+   Built twice, with BENCH_TICKLESS set to 1 and 0. Links all four
+   phases; this file is the start4.
+   ------------------------------------------------------------------------ */
+#include <stddef.h>
+#include <usloss.h>
+#include <libuser.h>
+
+#define IDLE_US 2000000
+#define SLEEPERS 4
+#define PERIOD_US 100000
+
+extern int tickless;
+extern void dump_clock_stats(void);
+
+/* Runs before startup, while the clock mode can still be chosen */
+__attribute__((constructor)) static void configure(void)
+{
+   tickless = BENCH_TICKLESS;
+}
+
+static int sleeper(char *arg)
+{
+   for (int i = 0; i < IDLE_US / PERIOD_US; i++)
+   {
+      SleepUs(PERIOD_US);
+   }
+   return 0;
+}
+
+static void report(char *pattern, int interrupts, int start, int end)
+{
+   console("%-22s %10d %10d %12.1f\n", pattern, end - start, interrupts,
+           interrupts * 1000000.0 / (end - start));
+}
+
+int start4(char *arg)
+{
+   int start;
+   int end;
+   int before;
+   int pid;
+   int status;
+
+   console("idle interrupts, clock %s\n", tickless ? "tickless" : "ticking");
+   console("pattern                 elapsed_us interrupts   per_second\n");
+
+   GetTimeofDay(&start);
+   before = interrupt_count();
+   SleepUs(IDLE_US);
+   GetTimeofDay(&end);
+   report("one sleeper", interrupt_count() - before, start, end);
+
+   GetTimeofDay(&start);
+   before = interrupt_count();
+   for (int i = 0; i < SLEEPERS; i++)
+   {
+      Spawn("sleeper", sleeper, NULL, USLOSS_MIN_STACK, 3, &pid);
+   }
+   for (int i = 0; i < SLEEPERS; i++)
+   {
+      Wait(&pid, &status);
+   }
+   GetTimeofDay(&end);
+   report("4 sleepers, 100ms", interrupt_count() - before, start, end);
+
+   dump_clock_stats();
+   return 0;
+}
@@ -0,0 +1,87 @@
+/* ------------------------------------------------------------------------
+   mbox_memory.c
+
+   Footprint of the mail slot table and payload pools, against what the
+   same MAXSLOTS slots took when every slot embedded a MAX_MESSAGE byte
+   buffer, and the latency of an MboxSend plus MboxReceive pair for a
+   message of each size class. Links phases 1 and 2; this file stands in
+   for phase 3.
+   ------------------------------------------------------------------------ */
+#include <stddef.h>
+#include <processManager.h>
+#include <mailboxManager.h>
+#include "message.h"
+
+#define PAIRS 100000
+
+/* A mail slot as it was with the payload embedded */
+struct embeddedSlot
+{
+   int mbox_id;
+   int isOccupied;
+   int index;
+   int messageSize;
+   int isRef;
+   void *ref;
+   char message[MAX_MESSAGE];
+   slot_ptr next_in_box;
+   slot_ptr prev_in_box;
+   mbox_proc_ptr associatedProcs;
+};
+
+extern payloadPool PayloadPools[NUM_SIZE_CLASSES];
+
+static void footprint(void)
+{
+   long before = (long)MAXSLOTS * sizeof(struct embeddedSlot);
+   long after = (long)MAXSLOTS * sizeof(mail_slot);
+
+   for (int i = 0; i < NUM_SIZE_CLASSES; i++)
+   {
+      // the buffers and their free stack
+      after += (long)PayloadPools[i].numBufs * (PayloadPools[i].bufSize + sizeof(int));
+   }
+
+   console("mail slot storage for %d slots\n", MAXSLOTS);
+   console("  embedded payloads  %8ld bytes\n", before);
+   console("  slots + pools      %8ld bytes\n", after);
+   console("  saved              %8ld bytes (%.0f%%)\n\n", before - after,
+           100.0 * (before - after) / before);
+}
+
+/* Times PAIRS send and receive pairs of size byte messages */
+static void latency(int size)
+{
+   char out[MAX_MESSAGE];
+   char in[MAX_MESSAGE];
+   int box = MboxCreate(1, size);
+   int start = sys_clock();
+   int elapsed;
+
+   for (int i = 0; i < PAIRS; i++)
+   {
+      out[0] = (char)i;
+      MboxSend(box, out, size);
+      MboxReceive(box, in, size);
+   }
+   elapsed = sys_clock() - start;
+
+   MboxRelease(box);
+   console("%6d %12d %12.0f\n", size, elapsed, elapsed * 1000.0 / PAIRS);
+}
+
+int start2(char *arg)
+{
+   int sizes[] = {0, SMALL_MSG_SIZE, MEDIUM_MSG_SIZE, MAX_MESSAGE};
+
+   footprint();
+
+   console("send + receive latency, %d pairs per row\n", PAIRS);
+   console("  size   elapsed_us      ns/pair\n");
+   for (int i = 0; i < 4; i++)
+   {
+      latency(sizes[i]);
+   }
+   halt(0);
+   return 0;
+}
@@ -0,0 +1,65 @@
+/* ------------------------------------------------------------------------
+   mbox_throughput.c
+
+   Mailbox throughput: MESSAGES messages through one mailbox with 1, 16
+   and 256 slots. start2 sends in bursts that fill the box to its depth
+   and then drains it, so every send appends to a queue already holding
+   up to depth - 1 messages. Nothing blocks, so this measures the queue
+   operations and not the context switches. The run ends with halt(0).
+   Links phases 1 and 2; this file stands in for phase 3.
+   ------------------------------------------------------------------------ */
+#include <stddef.h>
+#include <processManager.h>
+#include <mailboxManager.h>
+
+#define MESSAGES 10000
+
+/* Pushes MESSAGES messages through a box with the given number of slots */
+static void measure(int depth)
+{
+   int box = MboxCreate(depth, 2 * sizeof(int));
+   int msg[2];
+   int start;
+   int elapsed;
+   int next = 0;
+
+   start = sys_clock();
+   for (int sent = 0; sent < MESSAGES; sent += depth)
+   {
+      for (int i = sent; i < sent + depth; i++)
+      {
+         msg[0] = i;
+         msg[1] = -i;
+         MboxSend(box, msg, sizeof(msg));
+      }
+      for (int i = 0; i < depth; i++, next++)
+      {
+         MboxReceive(box, msg, sizeof(msg));
+         if (msg[0] != next)
+         {
+            console("mbox_throughput: got message %d, expected %d\n", msg[0], next);
+            halt(1);
+         }
+      }
+   }
+   elapsed = sys_clock() - start;
+
+   MboxRelease(box);
+   console("%6d %12d %12.0f %12.3f\n", depth, elapsed,
+           next * 1000000.0 / elapsed, (double)elapsed / next);
+}
+
+int start2(char *arg)
+{
+   int depths[] = {1, 16, 256};
+
+   console("mailbox throughput, %d messages of %d bytes per row\n",
+           MESSAGES, (int)(2 * sizeof(int)));
+   console(" depth   elapsed_us     msgs/sec       us/msg\n");
+   for (int i = 0; i < 3; i++)
+   {
+      measure(depths[i]);
+   }
+   halt(0);
+   return 0;
+}
@@ -0,0 +1,125 @@
+/* ------------------------------------------------------------------------
+   sched_mix.c
+
+   Scheduler latency with interactive and batch procs mixed. BATCH procs
+   spin in user mode; INTERACTIVE procs sleep SLEEP_US, then use
+   BURST_US of CPU, ROUNDS times. Every proc is spawned at priority 3.
+   Reported per policy: how late the interactive procs got the CPU back
+   after their sleeps (which, with the clock ticking, includes up to a
+   tick of sleep timer granularity), and the rate the batch procs got
+   loops done at.
+
+   Built twice, with BENCH_POLICY set to SCHED_FIXED and SCHED_MLFQ.
+   Links all four phases; this file is the start4.
+   ------------------------------------------------------------------------ */
+#include <stddef.h>
+#include <processManager.h>
+#include <libuser.h>
+#include "stats.h"
+#include "kernel.h"
+
+#define BATCH 3
+#define INTERACTIVE 3
+#define ROUNDS 20
+#define SLEEP_US 30000
+#define BURST_US 1000
+
+extern int schedPolicy;
+
+static volatile long batchLoops[BATCH];
+static int lateTotal[INTERACTIVE];
+static int lateMax[INTERACTIVE];
+static int finished; // V'd by each interactive proc as it finishes
+
+/* Runs before startup, while the policy can still be chosen */
+__attribute__((constructor)) static void configure(void)
+{
+   schedPolicy = BENCH_POLICY;
+}
+
+static int batch(char *arg)
+{
+   int id = arg[0] - '0';
+
+   while (1)
+   {
+      batchLoops[id]++;
+   }
+   return 0;
+}
+
+static int interactive(char *arg)
+{
+   int id = arg[0] - '0';
+   int before;
+   int after;
+   int now;
+
+   for (int i = 0; i < ROUNDS; i++)
+   {
+      GetTimeofDay(&before);
+      SleepUs(SLEEP_US);
+      GetTimeofDay(&after);
+
+      int late = after - before - SLEEP_US;
+      lateTotal[id] += late;
+      lateMax[id] = late > lateMax[id] ? late : lateMax[id];
+
+      do
+      {
+         GetTimeofDay(&now);
+      } while (now - after < BURST_US);
+   }
+   SemV(finished);
+   return 0;
+}
+
+int start4(char *arg)
+{
+   char ids[10][2] = {"0", "1", "2", "3", "4", "5", "6", "7", "8", "9"};
+   int pid;
+   int start;
+   int end;
+   int total = 0;
+   int worst = 0;
+   long loops = 0;
+
+   SemCreate(0, &finished);
+   GetTimeofDay(&start);
+   for (int i = 0; i < BATCH; i++)
+   {
+      Spawn("batch", batch, ids[i], USLOSS_MIN_STACK, 3, &pid);
+   }
+   for (int i = 0; i < INTERACTIVE; i++)
+   {
+      Spawn("interactive", interactive, ids[i], USLOSS_MIN_STACK, 3, &pid);
+   }
+
+   // the batch procs are left spinning, the run ends with the
+   // interactive procs
+   for (int i = 0; i < INTERACTIVE; i++)
+   {
+      SemP(finished);
+   }
+   GetTimeofDay(&end);
+
+   for (int i = 0; i < INTERACTIVE; i++)
+   {
+      total += lateTotal[i];
+      worst = lateMax[i] > worst ? lateMax[i] : worst;
+   }
+   for (int i = 0; i < BATCH; i++)
+   {
+      loops += batchLoops[i];
+   }
+
+   console("%s: %d batch + %d interactive procs, %d sleeps of %dus each\n",
+           BENCH_POLICY == SCHED_MLFQ ? "mlfq" : "fixed", BATCH, INTERACTIVE,
+           ROUNDS, SLEEP_US);
+   console("  wakeup lateness  avg %8d us   max %8d us\n",
+           total / (INTERACTIVE * ROUNDS), worst);
+   console("  batch loops      %ld million in %d ms, %ld per ms\n",
+           loops / 1000000, (end - start) / 1000, loops / ((end - start) / 1000));
+   halt(0);
+   return 0;
+}
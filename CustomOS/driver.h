@@ -1,40 +1,189 @@
 
 
 typedef struct driver_proc *driver_proc_ptr;
+typedef struct disk_request *disk_request_ptr;
+typedef struct DiskAsyncArgs DiskAsyncArgs;
+typedef struct diskCompletion diskCompletion;
 
-struct driver_proc
+/* Syscalls added on top of the ones in usyscall.h */
+#define SYS_SLEEPUS 30
+#define SYS_DISKREADASYNC 33
+#define SYS_DISKWRITEASYNC 34
+#define SYS_DISKCACHESTATS 35
+
+#define DISK_REQUESTS MAXPROC /* size of the disk request pool */
+
+#define CACHE_MAX_BLOCKS 256 /* most sectors the buffer cache can hold */
+#define CACHE_HASH_SIZE 64
+#define CACHE_RUN_MAX DISK_TRACK_SIZE /* most sectors one write back sends */
+
+#define RA_STAGES 8      /* read-ahead staging buffers shared by all streams */
+#define RA_MIN_WINDOW 4  /* sectors read ahead when a stream is first seen */
+#define RA_MAX_WINDOW 32
+
+/* Sequential read detection for one proc on one disk unit */
+typedef struct raStream
 {
-   driver_proc_ptr nextDiskReq;
-   driver_proc_ptr nextAsleep;
+   int next_track; /* where a sequential read would start, -1 if unknown */
+   int next_sector;
+   int window; /* sectors to read ahead, doubles while reads hit */
+   int stage;  /* staging buffer the stream last filled, -1 if none */
+} raStream;
 
+/* Disk scheduling policies */
+#define DISK_SCHED_FCFS 0
+#define DISK_SCHED_SSTF 1
+#define DISK_SCHED_SCAN 2
+#define DISK_SCHED_CSCAN 3
+
+struct driver_proc
+{
    int pid;
    int slot;
    int wake_time; /* for sleep syscall */
+   int heap_index; /* position in the sleep queue heap, -1 if not asleep */
    int been_zapped;
-   int semHandle;
+   int semHandle; /* private sem the proc sleeps on, disk requests have their own */
    int time_asleep; /* time when the proc started sleeping*/
 
-   /* Used for disk requests */
-   int operation; /* DISK_READ, DISK_WRITE, DISK_SEEK, DISK_TRACKS */
+   raStream streams[DISK_UNITS];
+};
+
+/* One read or write, taken from the request pool while it is in flight */
+struct disk_request
+{
+   disk_request_ptr next; /* next in the disk queue or the free list */
+
+   int handle;    /* returned by the async syscalls, posted on completion */
+   int operation; /* DISK_READ or DISK_WRITE */
    int track_start;
    int sector_start;
    int num_sectors; // num sectors to read or write
    int sectors_read;
-   int current_track;
-   int current_sector;
    int unit;
    void *disk_buf;
+   int io_status; /* device status of a failed transfer, 0 on success */
+   int enqueue_time; /* when the request joined the disk queue */
+
+   int doneSem; /* this descriptor's own completion semaphore */
+
+   /* how the requester hears about completion */
+   int mboxID; /* gets a diskCompletion for an async request, -1 to V doneSem */
+   int reservation; /* slot of mboxID set aside for the diskCompletion */
+   int stage;     /* read-ahead stage this request fills, -1 if none */
+   struct cacheBlock *block; /* cache block an async write back is for, or NULL */
+
+   disk_request_ptr merged; /* next request served by the same device pass */
+};
+
+/* Passed in arg1 of the DiskReadAsync and DiskWriteAsync syscalls */
+struct DiskAsyncArgs
+{
+   void *buffer; /* must stay valid until the completion arrives */
+   int sectors;
+   int track;
+   int first; /* first sector */
+   int unit;
+   int mboxID; /* mailbox the diskCompletion is sent to */
+};
+
+/* Sent to the mailbox of an async request once it is done */
+struct diskCompletion
+{
+   int handle;
+   int status; /* 0 on success, the device status otherwise */
+   int bytes;  /* bytes actually transferred */
 };
 
 typedef struct sleepQueue
 {
-   int hasProc;
-   driver_proc_ptr head;
+   int size;
+   driver_proc_ptr heap[MAXPROC]; /* min-heap on wake_time */
 } sleepQueue;
 
 typedef struct diskQueue
 {
    int hasProc;
-   driver_proc_ptr head;
+   disk_request_ptr head;
+   disk_request_ptr tail;
+
+   int policy;    /* one of the DISK_SCHED_ policies */
+   int arm_track; /* track the arm of this unit is on */
+   int direction; /* 1 when the arm is sweeping up, -1 down (SCAN) */
+
+   /* for the seek and latency report */
+   int requests_served;
+   int merged_requests; /* requests that rode along on another's device pass */
+   long device_ops;     /* seeks and transfers sent to the device */
+   long total_seek_distance;
+   long total_latency; /* microseconds from enqueue to completion */
+} diskQueue;
+
+typedef struct diskRequestPool
+{
+   int numFree;
+   int nextHandle;
+   int lostCompletions; /* async completions whose mailbox was released */
+   int waiters;   /* procs blocked on waitSem until a request is freed */
+   int waitSem;
+   int poolWaits; /* times a proc had to wait for a free request */
+   disk_request_ptr freeList;
+   struct disk_request requests[DISK_REQUESTS];
+} diskRequestPool;
 
-} diskQueue;
\ No newline at end of file
+/* One cached sector of the buffer cache */
+typedef struct cacheBlock
+{
+   int valid;
+   int dirty;      /* 1 if newer than the copy on disk */
+   int referenced; /* second chance bit for the CLOCK hand */
+   int busy;       /* 1 while a write back of it is in flight */
+   int dropped;    /* overwritten by an async write, freed once not busy */
+   int unit;
+   int track;
+   int sector;
+   int hashNext; /* next block in the same hash chain, -1 at the end */
+   char data[DISK_SECTOR_SIZE];
+} cacheBlock;
+
+/* Returned by the DiskCacheStats syscall */
+typedef struct diskCacheStats
+{
+   int capacity;   /* in sectors */
+   int hits;       /* DiskReads served without the device */
+   int misses;     /* DiskReads that went to the device */
+   int dirty;      /* dirty sectors in the cache right now */
+   int writebacks; /* dirty sectors written to disk */
+   int evictions;
+   int raIssued; /* read-ahead requests sent to the device */
+   int raHits;   /* DiskReads served from a read-ahead stage */
+   int raWasted; /* stages refilled or invalidated before any hit */
+} diskCacheStats;
+
+/* Write-back cache of disk sectors keyed by (unit, track, sector) */
+typedef struct bufferCache
+{
+   int hand; /* CLOCK hand, next block to consider for eviction */
+   int busyWaiters; /* procs waiting on busySem for a write back to finish */
+   int busySem;
+   int hashHeads[CACHE_HASH_SIZE];
+   diskCacheStats stats;
+   cacheBlock blocks[CACHE_MAX_BLOCKS];
+} bufferCache;
+
+/* Sectors read ahead for a stream, waiting for the read that wants them */
+typedef struct raStage
+{
+   int owner;   /* Driver_Table slot of the stream using it, -1 if free */
+   int pending; /* 1 while the device is filling it */
+   int valid;   /* 1 if data holds count sectors from unit, track, sector */
+   int stale;   /* a write overlapped it while pending, drop the data */
+   int used;    /* 1 once a read was served from it */
+   int unit;
+   int track;
+   int sector;
+   int count;
+   int waiters; /* readers blocked on sem until it fills */
+   int sem;
+   char data[RA_MAX_WINDOW * DISK_SECTOR_SIZE];
+} raStage;
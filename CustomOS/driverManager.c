@@ -1,13 +1,26 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <processManager.h>
+#include <mailboxManager.h>
 #include <usloss.h>
 #include <usyscall.h>
 #include <libuser.h>
 #include "driver.h"
+#include "trace.h"
+#include "stats.h"
 
 static int running;  /*semaphore to synchronize drivers and start3*/
-int trackNumber = 0; // Sector where the disk head is currently pointing
+static int diskMutex; /*guards the disk request pool and the disk queues*/
+static int cacheMutex; /*guards the buffer cache*/
+static int statsMutex; /*guards diskCache.stats, taken last and held only to count*/
+static int flushSem;   /*V'd when the cache goes from clean to dirty*/
+static int flusherQuit = 0; /*set by start3 to make the flusher finish*/
+static int clockSem; /*the clock driver waits on this while nobody is asleep*/
+int diskSchedPolicy = DISK_SCHED_CSCAN; // policy each disk unit starts with
+int cacheCapacity = 64;           // sectors the buffer cache may hold, 0 turns it off
+int cacheFlushInterval = 1000000; // microseconds between passes of the flusher
+int diskMerging = 1;              // 0 to give every request its own device pass
 
 const int DEBUG4 = 0;
 const int debugflag4 = 1;
@@ -16,24 +29,96 @@ const int debugflag4 = 1;
 static struct driver_proc Driver_Table[MAXPROC];
 static sleepQueue sleepingProcs;
 static struct diskQueue diskRequests[DISK_UNITS];
+static diskRequestPool requestPool;
+static bufferCache diskCache;
+static raStage raStages[RA_STAGES];
 
 static int diskpids[DISK_UNITS];
 static int num_tracks[DISK_UNITS];
 static int diskSemaphores[DISK_UNITS];
+static int diskShutdown = 0; /*set by start3 once the drivers should quit*/
+
+/* clock driver activity, for the wakeup report */
+static int clockWakeups = 0;
+static int clockStartTime = 0;
 
 /* PROTOTYPES */
 static int ClockDriver(char *);
 static int DiskDriver(char *);
+static int DiskFlusher(char *);
 void sleep_sys(sysargs *pArgs);
 void disk_size_sys(sysargs *pArgs);
 void disk_write_sys(sysargs *pArgs);
 void disk_read_sys(sysargs *pArgs);
+void disk_read_async_sys(sysargs *pArgs);
+void disk_write_async_sys(sysargs *pArgs);
+void submitAsync(sysargs *, int);
+void initRequestPool(void);
+disk_request_ptr newDiskRequest(int, void *, int, int, int, int, int);
+void freeDiskRequest(disk_request_ptr);
+void completeDiskRequest(disk_request_ptr);
+int doDiskIO(int, void *, int, int, int, int);
+void startDiskIO(disk_request_ptr);
+int finishDiskIO(disk_request_ptr);
+void disk_cache_stats_sys(sysargs *pArgs);
+void initCache(void);
+void nextSector(int, int *, int *);
+cacheBlock *cacheLookup(int, int, int);
+cacheBlock *cacheAlloc(int, int, int);
+void cacheUnhash(cacheBlock *);
+int writeBack(cacheBlock *);
+static int cacheRequest(disk_request_ptr *);
+static void writeBackDone(cacheBlock **, int, int);
+void cacheWriteBackDone(cacheBlock *, int);
+static int cacheClean(void);
+static void cacheWaitBusy(void);
+static int midRun(cacheBlock *);
+int cacheRead(char *, int, int, int, int);
+void cacheFill(char *, int, int, int, int);
+int cacheWrite(char *, int, int, int, int);
+void cacheSyncRange(int, int, int, int, int);
+void cacheQueueWriteBacks(int, int, int, int);
+void cacheDropRange(int, int, int, int);
+void flushCache(void);
+static void countStat(int *, int);
+void initReadAhead(void);
+int readAheadHit(char *, int, int, int, int);
+void readAhead(int, int);
+void updateStream(int, int, int, int, int, int);
+void stageComplete(disk_request_ptr);
+void raInvalidate(int, int, int, int);
+void sleep_us_sys(sysargs *pArgs);
+void sleepFor(int);
 void addToSleepQueue(int);
 int removeFromSleepQueue(void);
-void addToDiskQueue(int, int);
-void removeFromDiskQueue(int);
-void handleDiskRead(int, int);
-void handleDiskWrite(int, int);
+void cancelSleep(int);
+void siftUp(int);
+void siftDown(int);
+void addToDiskQueue(disk_request_ptr, int);
+disk_request_ptr removeFromDiskQueue(int);
+int trackDistance(int, int);
+void dump_disk_stats(void);
+void dump_clock_stats(void);
+void handleDiskTransfer(disk_request_ptr, int);
+void mergeRequests(diskQueue *, disk_request_ptr);
+static int linearSector(int, int);
+static int reqStart(disk_request_ptr);
+static int reqEnd(disk_request_ptr);
+static char *sectorBuf(disk_request_ptr, int);
+static disk_request_ptr firstConflict(diskQueue *, disk_request_ptr, disk_request_ptr *);
+void seekTo(int, int);
+extern int tickless; // phase 1
+extern int MboxExists(int); // phase 2
+extern int MboxReserve(int);
+extern int MboxSendReserved(int, int, void *, int);
+extern int semcreate_real(int); // phase 3
+extern int semp_real(int);
+extern int semv_real(int);
+extern void gettimeofday_real(int *);
+extern void getPID_real(int *);
+extern int spawn_real(char *, int (*)(char *), char *, int, int);
+extern int wait_real(int *);
+extern int start4(char *);
 
 int start3(char *arg)
 {
@@ -41,6 +126,7 @@ int start3(char *arg)
     char termbuf[10];
     int i;
     int clockPID;
+    int flusherPID;
     int pid;
     int status;
 
@@ -52,26 +138,48 @@ int start3(char *arg)
 
     /* Assignment system call handlers */
     sys_vec[SYS_SLEEP] = sleep_sys;
+    sys_vec[SYS_SLEEPUS] = sleep_us_sys;
     sys_vec[SYS_DISKSIZE] = disk_size_sys;
     sys_vec[SYS_DISKREAD] = disk_read_sys;
     sys_vec[SYS_DISKWRITE] = disk_write_sys;
+    sys_vec[SYS_DISKREADASYNC] = disk_read_async_sys;
+    sys_vec[SYS_DISKWRITEASYNC] = disk_write_async_sys;
+    sys_vec[SYS_DISKCACHESTATS] = disk_cache_stats_sys;
 
     memset(Driver_Table, 0, MAXPROC * sizeof(Driver_Table[0]));
-    sleepingProcs.hasProc = 0;
-    diskRequests[0].hasProc = 0;
-    diskRequests[1].hasProc = 0;
+    sleepingProcs.size = 0;
+    memset(diskRequests, 0, DISK_UNITS * sizeof(diskRequests[0]));
+    for (int j = 0; j < DISK_UNITS; j++)
+    {
+        diskRequests[j].policy = diskSchedPolicy;
+        diskRequests[j].direction = 1;
+    }
 
     for (int i = 0; i < MAXPROC; i++)
     {
         Driver_Table[i].semHandle = semcreate_real(0); // initialize private sems
+        Driver_Table[i].heap_index = -1;
+        for (int j = 0; j < DISK_UNITS; j++)
+        {
+            Driver_Table[i].streams[j].next_track = -1;
+            Driver_Table[i].streams[j].stage = -1;
+        }
     }
 
     for (int j = 0; j < DISK_UNITS; j++)
     {
         diskSemaphores[j] = semcreate_real(0);
     }
+    diskMutex = semcreate_real(1);
+    cacheMutex = semcreate_real(1);
+    statsMutex = semcreate_real(1);
+    flushSem = semcreate_real(0);
+    initRequestPool();
+    initCache();
+    initReadAhead();
 
     running = semcreate_real(0);
+    clockSem = semcreate_real(0);
     clockPID = fork1("Clock driver", ClockDriver, NULL, USLOSS_MIN_STACK, 2);
     if (clockPID < 0)
     {
@@ -100,6 +208,13 @@ int start3(char *arg)
     semp_real(running);
     semp_real(running);
 
+    flusherPID = fork1("Disk flusher", DiskFlusher, NULL, USLOSS_MIN_STACK, 4);
+    if (flusherPID < 0)
+    {
+        console("start3(): Can't create disk flusher\n");
+        halt(1);
+    }
+
     /*
      * Create first user-level process and wait for it to finish.
      */
@@ -109,9 +224,22 @@ int start3(char *arg)
     /*
      * Zap the device drivers
      */
-    zap(clockPID); // clock driver
-    join(&status); /* for the Clock Driver */
+    if (DEBUG4 && debugflag4)
+    {
+        dump_disk_stats();
+        dump_clock_stats();
+    }
+
+    flusherQuit = 1;
+    semv_real(flushSem); // in case it is idle and waiting for a dirty sector
+    zap(flusherPID);     // it writes back what is still dirty before quitting
+    join(&status);
 
+    semv_real(clockSem); // in case it is idle and not polling the clock
+    zap(clockPID);       // clock driver, waits for it to quit
+    join(&status);       /* for the Clock Driver */
+
+    diskShutdown = 1;
     for (int j = 0; j < DISK_UNITS; j++)
     {
         semv_real(diskSemaphores[j]); // this will break the diskdriver loop if nothing is queued for it
@@ -123,7 +251,8 @@ int start3(char *arg)
 
 /*
  * ClockDriver Proc. Functions as the driver for the clock.
- * Waits for a clock interrupt and handles it accordingly.
+ * Waits for a clock interrupt and handles it accordingly. A tickless
+ * clock is programmed for the earliest sleeper before each wait.
  */
 static int
 ClockDriver(char *arg)
@@ -137,33 +266,69 @@ ClockDriver(char *arg)
     semv_real(running);
     psr_set(psr_get() | PSR_CURRENT_INT);
     int curTime;
+    gettimeofday_real(&clockStartTime);
     while (!is_zapped())
     {
+        /*
+         * With nobody asleep there is nothing to time, so rather than
+         * waking on every clock interrupt wait for the next sleeper.
+         */
+        if (tickless && sleepingProcs.size == 0)
+        {
+            semp_real(clockSem);
+            continue;
+        }
+
+        // a tickless clock only interrupts when asked to
+        if (sleepingProcs.size > 0)
+        {
+            clock_program(sleepingProcs.heap[0]->wake_time);
+        }
         result = waitdevice(CLOCK_DEV, 0, &status);
         if (result != 0)
         {
             return 0;
         }
+        clockWakeups++;
         /*
          * Compute the current time and wake up any processes
          * whose time has come.
          */
         gettimeofday_real(&curTime);
         int removedSlot;
-        int privateSem;
-        driver_proc_ptr procInQueue = sleepingProcs.head;
 
-        while (procInQueue != NULL && curTime >= procInQueue->wake_time)
+        // wake every sleeper that came due during this tick
+        while (sleepingProcs.size > 0 && curTime >= sleepingProcs.heap[0]->wake_time)
         {
             removedSlot = removeFromSleepQueue();
-            if (removedSlot != -1) // this would mean there was nothing to remove
-            {
-                privateSem = Driver_Table[removedSlot].semHandle;
-                semv_real(privateSem); // wake the proc up
-            }
-            procInQueue = sleepingProcs.head; // head should be changed after call to removeFromSleepQueue
+            semv_real(Driver_Table[removedSlot].semHandle); // wake the proc up
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Writes the dirty sectors of the buffer cache back to disk. While the
+ * cache is clean it waits on flushSem instead of waking up every period,
+ * so an idle system stays idle; once a sector is dirtied it gives more
+ * writes cacheFlushInterval microseconds to collect and flushes them
+ * together. Flushes once more when start3 shuts it down.
+ */
+static int
+DiskFlusher(char *arg)
+{
+    while (!flusherQuit && !is_zapped())
+    {
+        semp_real(flushSem);
+        if (flusherQuit)
+        {
+            break;
         }
+        sleepFor(cacheFlushInterval);
+        flushCache();
     }
+    flushCache();
 
     return 0;
 }
@@ -181,10 +346,8 @@ DiskDriver(char *arg)
     int result;
     int waitResult;
     int status;
-    int op;
-    int slot;
 
-    driver_proc_ptr current_req;
+    disk_request_ptr current_req;
 
     if (DEBUG4 && debugflag4)
         console("DiskDriver(%d): started\n", unit);
@@ -208,7 +371,8 @@ DiskDriver(char *arg)
 
     /* initialize disk arm position to 0*/
     my_request.opr = DISK_SEEK;
-    my_request.reg1 = (void *)trackNumber;
+    my_request.reg1 = (void *)0;
+    diskRequests[unit].arm_track = 0;
     device_output(DISK_DEV, unit, &my_request);
     waitdevice(DISK_DEV, unit, &status);
 
@@ -224,45 +388,28 @@ DiskDriver(char *arg)
         // wait for a request
         semp_real(diskSemaphores[unit]);
 
-        if (diskRequests[unit].hasProc) // make sure there is a disk request in the list
+        semp_real(diskMutex);
+        current_req = removeFromDiskQueue(unit); // the scheduler picks the request
+        semv_real(diskMutex);
+        if (current_req != NULL) // make sure there is a disk request in the list
         {
-            slot = diskRequests[unit].head->slot;
-            op = diskRequests[unit].head->operation;
-            // Check if we are on the proper track, if not, seek to it
-            if (Driver_Table[slot].track_start != trackNumber)
-            {
-                // Seek to the proper track
-                my_request.opr = DISK_SEEK;
-                my_request.reg1 = (void *)Driver_Table[slot].track_start;
-                device_output(DISK_DEV, unit, &my_request);
-                waitResult = waitdevice(DISK_DEV, unit, &status);
-
-                if (waitResult != DEV_OK)
-                {
-                    console("DiskDriver %d, did not get DEV_OK on DISKS_Tracks call \n", unit);
-                    halt(1);
-                }
-
-                trackNumber = Driver_Table[slot].track_start; // update the global variable
-            }
-
-            if (op == DISK_READ)
-            {
-                handleDiskRead(slot, unit);
-            }
-            else if (op == DISK_WRITE)
+            if (current_req->operation == DISK_READ || current_req->operation == DISK_WRITE)
             {
-                handleDiskWrite(slot, unit);
+                handleDiskTransfer(current_req, unit);
             }
             else
             {
                 console("This should not execute \n"); // Operation should only be a read or a write
             }
         }
-        else
+        else if (diskShutdown)
         {
             break; // If there is no process in the queue, then sem_v occured by start3
         }
+        /*
+         * Otherwise the V belonged to a request that was merged into an
+         * earlier pass, so there is nothing to do but wait again.
+         */
     }
 
     return 0;
@@ -284,6 +431,34 @@ void sleep_sys(sysargs *pArgs)
         return;
     }
 
+    sleepFor(secsToSleep * 1000000); // convert secs to Sleep to micro seconds
+    pArgs->arg4 = 0;
+}
+
+/*
+ * Pointed to by the syscall vector for the SleepUs syscall. Same as
+ * sleep_sys, but the time to sleep is given in microseconds.
+ */
+void sleep_us_sys(sysargs *pArgs)
+{
+    int microsToSleep = (int)pArgs->arg1;
+
+    if (microsToSleep < 0)
+    {
+        pArgs->arg4 = -1;
+        return;
+    }
+
+    sleepFor(microsToSleep);
+    pArgs->arg4 = 0;
+}
+
+/*
+ * Puts the calling proc in the sleep queue and blocks it on its
+ * private semaphore until the clock driver wakes it.
+ */
+void sleepFor(int micros)
+{
     int curTime;
     gettimeofday_real(&curTime);
     int procPid;
@@ -293,12 +468,10 @@ void sleep_sys(sysargs *pArgs)
     Driver_Table[slot].slot = slot;
 
     Driver_Table[slot].time_asleep = curTime;
-    Driver_Table[slot].wake_time = curTime + (secsToSleep * 1000000); // convert secs to Sleep to micro seconds
+    Driver_Table[slot].wake_time = curTime + micros;
     addToSleepQueue(slot);
     int semNum = Driver_Table[slot].semHandle; // private sem for wakeup
     semp_real(semNum);                         // P the semaphore, this causes the sleep
-
-    pArgs->arg4 = 0;
 }
 
 /*
@@ -344,8 +517,6 @@ void disk_read_sys(sysargs *pArgs)
     int startTrack = (int)pArgs->arg3;
     int startSector = (int)pArgs->arg4;
     int unit = (int)pArgs->arg5;
-    int procSlot;
-    int pid;
 
     if (sectorsToRead < 0 || startTrack < 0 || startSector < 0)
     {
@@ -358,25 +529,38 @@ void disk_read_sys(sysargs *pArgs)
         pArgs->arg4 = -1;
         return;
     }
+
+    int pid;
     getPID_real(&pid);
+    int status = 0;
+    int stageHit = 0;
+
+    // served entirely from the buffer cache, no device work
+    if (cacheRead(buffer, sectorsToRead, startTrack, startSector, unit))
+    {
+        status = 0;
+    }
+    else if (readAheadHit(buffer, sectorsToRead, startTrack, startSector, unit))
+    {
+        stageHit = 1;
+        cacheFill(buffer, sectorsToRead, startTrack, startSector, unit);
+    }
+    else
+    {
+        status = doDiskIO(DISK_READ, buffer, sectorsToRead, startTrack, startSector, unit);
+        if (status == 0)
+        {
+            cacheFill(buffer, sectorsToRead, startTrack, startSector, unit);
+        }
+    }
 
-    // fill in the fields
-    procSlot = pid % MAXPROC;
-    Driver_Table[procSlot].slot = procSlot;
-    Driver_Table[procSlot].operation = DISK_READ;
-    Driver_Table[procSlot].num_sectors = sectorsToRead;
-    Driver_Table[procSlot].disk_buf = buffer;
-    Driver_Table[procSlot].track_start = startTrack;
-    Driver_Table[procSlot].sector_start = startSector;
-    Driver_Table[procSlot].unit = unit;
-    Driver_Table[procSlot].current_track = startTrack;
-    Driver_Table[procSlot].current_sector = startSector;
+    if (status == 0)
+    {
+        updateStream(pid % MAXPROC, unit, sectorsToRead, startTrack, startSector, stageHit);
+    }
 
+    pArgs->arg1 = status;
     pArgs->arg4 = 0;
-    addToDiskQueue(procSlot, unit);
-    semv_real(diskSemaphores[unit]);             // wake up the disk driver
-    semp_real(Driver_Table[procSlot].semHandle); // block the calling proc till this is handled
-    pArgs->arg1 = 0;
 }
 
 /*
@@ -392,8 +576,6 @@ void disk_write_sys(sysargs *pArgs)
     int startTrack = (int)pArgs->arg3;
     int startSector = (int)pArgs->arg4;
     int unit = (int)pArgs->arg5;
-    int procSlot;
-    int pid;
 
     if (sectorsToWrite < 0 || startTrack < 0 || startSector < 0 ||
         startTrack > 16 || startSector > 16)
@@ -407,283 +589,1641 @@ void disk_write_sys(sysargs *pArgs)
         pArgs->arg4 = -1;
         return;
     }
-    getPID_real(&pid);
+    int status;
 
-    // fill in the fields
-    procSlot = pid % MAXPROC;
-    Driver_Table[procSlot].slot = procSlot;
-    Driver_Table[procSlot].operation = DISK_WRITE;
-    Driver_Table[procSlot].num_sectors = sectorsToWrite;
-    Driver_Table[procSlot].disk_buf = pArgs->arg1;
-    Driver_Table[procSlot].track_start = startTrack;
-    Driver_Table[procSlot].sector_start = startSector;
-    Driver_Table[procSlot].unit = unit;
-    Driver_Table[procSlot].current_track = startTrack;
-    Driver_Table[procSlot].current_sector = startSector;
+    raInvalidate(sectorsToWrite, startTrack, startSector, unit);
+    if (cacheCapacity > 0 && sectorsToWrite <= cacheCapacity / 2)
+    {
+        status = cacheWrite(buffer, sectorsToWrite, startTrack, startSector, unit);
+    }
+    else
+    {
+        // too big to cache without flushing everything else out
+        cacheSyncRange(sectorsToWrite, startTrack, startSector, unit, 1);
+        status = doDiskIO(DISK_WRITE, buffer, sectorsToWrite, startTrack, startSector, unit);
+    }
 
+    pArgs->arg1 = status;
     pArgs->arg4 = 0;
-    addToDiskQueue(procSlot, unit);
-    semv_real(diskSemaphores[unit]);             // wake up the disk driver
-    semp_real(Driver_Table[procSlot].semHandle); // block the calling proc till this is handled
-    pArgs->arg1 = 0;
 }
 
 /*
- * This is a helper function to help the disk driver to handle
- * a disk read operation. The argument is the slot in which the
- * calling process occupies within the Driver_Table table and the disk unit.
+ * Pointed to by the syscall vector for DiskReadAsync. Queues a read
+ * and returns its handle in arg1 without waiting for it.
  */
-void handleDiskRead(int slot, int unit)
+void disk_read_async_sys(sysargs *pArgs)
 {
-    device_request dev_req;
-    int status;
+    submitAsync(pArgs, DISK_READ);
+}
+
+/*
+ * Pointed to by the syscall vector for DiskWriteAsync. Queues a write
+ * and returns its handle in arg1 without waiting for it.
+ */
+void disk_write_async_sys(sysargs *pArgs)
+{
+    submitAsync(pArgs, DISK_WRITE);
+}
+
+/*
+ * Does the work of the async disk syscalls. arg1 points to a
+ * DiskAsyncArgs. On success arg1 is the request handle and arg4 is 0.
+ * arg4 is -1 for bad arguments, which includes a zero sector count and
+ * a completion mailbox that doesn't exist, and -2 if that mailbox has no
+ * slot left for the completion. If the request pool is used up the
+ * caller blocks until a request is freed; it never waits for the disk.
+ * A diskCompletion carrying the handle is sent to the given mailbox
+ * when the request is done, into a slot set aside for it here.
+ */
+void submitAsync(sysargs *pArgs, int op)
+{
+    DiskAsyncArgs *args = pArgs->arg1;
 
-    // read specified number of sectors
-    for (int i = 0; i < Driver_Table[slot].num_sectors; i++)
+    if (args == NULL || !(args->unit == 0 || args->unit == 1) || args->sectors <= 0 ||
+        args->track < 0 || args->track >= num_tracks[args->unit] ||
+        args->first < 0 || args->first >= DISK_TRACK_SIZE ||
+        !MboxExists(args->mboxID))
     {
-        dev_req.opr = DISK_READ;
-        dev_req.reg1 = Driver_Table[slot].current_sector;
-        dev_req.reg2 = Driver_Table[slot].disk_buf;
-        device_output(DISK_DEV, unit, &dev_req);
-        waitdevice(DISK_DEV, unit, &status);
+        pArgs->arg4 = -1;
+        return;
+    }
 
-        if (Driver_Table[slot].num_sectors > 1)
-        {
-            // advance current sector
-            Driver_Table[slot].current_sector++;
+    // refuse now rather than lose the completion to a full mailbox later
+    int reservation = MboxReserve(args->mboxID);
+    if (reservation < 0)
+    {
+        pArgs->arg4 = reservation;
+        return;
+    }
 
-            // wrap around if needed
-            if (Driver_Table[slot].current_sector > DISK_TRACK_SIZE)
-            {
-                trackNumber = (trackNumber + 1) % num_tracks[unit];
-                Driver_Table[slot].current_sector = 0;
-                Driver_Table[slot].current_track = trackNumber;
-
-                // Seek to the proper track
-                dev_req.opr = DISK_SEEK;
-                dev_req.reg1 = (void *)trackNumber;
-                device_output(DISK_DEV, unit, &dev_req);
-                waitdevice(DISK_DEV, unit, &status);
-            }
-            // Since this is a pointer we advance it by sector size if needed
-            Driver_Table[slot].disk_buf = Driver_Table[slot].disk_buf + DISK_SECTOR_SIZE;
-        }
+    /* the device must see what the cache holds for these sectors; the
+     * write backs are queued ahead of the request, nothing waits here */
+    if (op == DISK_WRITE)
+    {
+        cacheDropRange(args->sectors, args->track, args->first, args->unit);
+        raInvalidate(args->sectors, args->track, args->first, args->unit);
+    }
+    else
+    {
+        cacheQueueWriteBacks(args->sectors, args->track, args->first, args->unit);
     }
 
-    removeFromDiskQueue(unit);               // The request can now be removed
-    semv_real(Driver_Table[slot].semHandle); // Wake up the calling proc now that this has been handled
+    disk_request_ptr req = newDiskRequest(op, args->buffer, args->sectors, args->track, args->first, args->unit, 1);
+    req->mboxID = args->mboxID;
+    req->reservation = reservation;
+
+    pArgs->arg1 = req->handle;
+    pArgs->arg4 = 0;
+    addToDiskQueue(req, args->unit);
+    semv_real(diskSemaphores[args->unit]); // wake up the disk driver
 }
 
 /*
- * This is a helper function to help the disk driver to handle
- * a disk write operation. The argument is the slot in which the
- * calling process occupies within the Driver_Table table and the disk unit.
+ * This is a helper function to help the disk driver to handle a disk
+ * read or write. The arguments are the request, along with the requests
+ * merged into it, and the disk unit. The sectors of all of them are
+ * issued as one run, the part of it on each track that lands in one
+ * request's buffer going out as a single DISK_READ_RUN or
+ * DISK_WRITE_RUN, and the arm only moves when the run crosses onto the
+ * next track. A sector several merged reads want is read once and
+ * copied to the others. A failed operation counts as transferring none
+ * of its sectors.
  */
-void handleDiskWrite(int slot, int unit)
+void handleDiskTransfer(disk_request_ptr first, int unit)
 {
-
     device_request dev_req;
-    int status;
-    int waitResult;
+    disk_request_ptr req;
+    int status = DEV_READY;
+    int start = reqStart(first);
+    int end = reqEnd(first);
+    int pos;
+    int count = 0;
+
+    for (req = first->merged; req != NULL; req = req->merged)
+    {
+        start = reqStart(req) < start ? reqStart(req) : start;
+        end = reqEnd(req) > end ? reqEnd(req) : end;
+    }
+
+    TRACE(TRACE_DISK_DISPATCH, unit, first->track_start);
 
-    // write to specified number of sectors
-    for (int i = 0; i < Driver_Table[slot].num_sectors; i++)
+    for (pos = start; pos < end; pos += count)
     {
-        dev_req.opr = DISK_WRITE;
-        dev_req.reg1 = Driver_Table[slot].current_sector;
-        dev_req.reg2 = Driver_Table[slot].disk_buf;
+        disk_request_ptr owner = first;
+        int trackEnd = (pos / DISK_TRACK_SIZE + 1) * DISK_TRACK_SIZE;
+
+        // the first request that wants this sector supplies the buffer
+        while (pos < reqStart(owner) || pos >= reqEnd(owner))
+        {
+            owner = owner->merged;
+        }
+        count = (reqEnd(owner) < trackEnd ? reqEnd(owner) : trackEnd) - pos;
+
+        // move tracks if sector boundary is crossed
+        seekTo(unit, (pos / DISK_TRACK_SIZE) % num_tracks[unit]);
 
+        dev_req.opr = first->operation == DISK_READ ? DISK_READ_RUN : DISK_WRITE_RUN;
+        dev_req.reg1 = (void *)(pos % DISK_TRACK_SIZE);
+        dev_req.reg2 = sectorBuf(owner, pos);
+        dev_req.reg3 = (void *)(long)count;
         device_output(DISK_DEV, unit, &dev_req);
         waitdevice(DISK_DEV, unit, &status);
+        diskRequests[unit].device_ops++;
+
+        if (status != DEV_READY)
+        {
+            break;
+        }
 
-        if (Driver_Table[slot].num_sectors > 1)
+        for (req = first; first->operation == DISK_READ && req != NULL; req = req->merged)
         {
-            // advance current sector
-            Driver_Table[slot].current_sector++;
+            int from = reqStart(req) > pos ? reqStart(req) : pos;
+            int to = reqEnd(req) < pos + count ? reqEnd(req) : pos + count;
 
-            // move tracks if sector boundary is crossed
-            if (Driver_Table[slot].current_sector > DISK_TRACK_SIZE)
+            if (req != owner && from < to)
             {
-                trackNumber = (trackNumber + 1) % num_tracks[unit];
-                Driver_Table[slot].current_sector = 0;
-
-                // Seek to the proper track
-                dev_req.opr = DISK_SEEK;
-                dev_req.reg1 = (void *)trackNumber;
-                device_output(DISK_DEV, unit, &dev_req);
-                waitdevice(DISK_DEV, unit, &status);
+                memcpy(sectorBuf(req, from), sectorBuf(owner, from), (to - from) * DISK_SECTOR_SIZE);
             }
-            // Since this is a pointer we advance it by sector size if needed
-            Driver_Table[slot].disk_buf = Driver_Table[slot].disk_buf + DISK_SECTOR_SIZE;
         }
     }
-    removeFromDiskQueue(unit);               // The request can now be removed
-    semv_real(Driver_Table[slot].semHandle); // Wake up the calling proc now that this has been handled
+
+    // fan the result out, pos is where the run stopped
+    int now;
+    gettimeofday_real(&now);
+    for (req = first; req != NULL;)
+    {
+        disk_request_ptr next = req->merged; // req may go back to the pool
+        int done = pos - reqStart(req);
+
+        done = done < 0 ? 0 : done;
+        req->sectors_read = done < req->num_sectors ? done : req->num_sectors;
+        req->io_status = req->sectors_read < req->num_sectors ? status : 0; // report a failure to the caller
+
+        diskRequests[unit].requests_served++;
+        diskRequests[unit].total_latency += now - req->enqueue_time;
+        TRACE(TRACE_DISK_COMPLETE, unit, req->io_status);
+
+        completeDiskRequest(req);
+        req = next;
+    }
 }
 
 /*
- * Adds a process to the sleep queue. The argument should be the slot
- * that the proc occupies in the Driver_Table array.
- * Nothing is returned
+ * Takes every queued request that can share a device pass with first
+ * off the queue and chains it onto first->merged. Reads merge when
+ * their sectors overlap or touch the run so far, so a duplicate read
+ * is only done once. Writes only merge when they touch it without
+ * overlapping, since which overlapping write should win isn't known.
+ * Neither merges ahead of an earlier request it must not pass.
+ * The caller holds diskMutex.
  */
-void addToSleepQueue(int slot)
+void mergeRequests(diskQueue *q, disk_request_ptr first)
 {
-    /* If this is the first proc being added to the queue, make it the head*/
-    if (sleepingProcs.hasProc == 0)
+    disk_request_ptr tail = first;
+    int start = reqStart(first);
+    int end = reqEnd(first);
+    int mergedOne = 1;
+
+    first->merged = NULL;
+    if (!diskMerging || first->num_sectors == 0)
     {
-        sleepingProcs.head = &Driver_Table[slot];
-        sleepingProcs.hasProc = 1;
+        return;
     }
-    else
+
+    // each merge grows the run, so look again until nothing fits
+    while (mergedOne)
     {
-        /* Otherwise, insert it into queue, but maintain sorted order (lowest to highest)*/
-        int wakeTime = Driver_Table[slot].wake_time;
-        driver_proc_ptr cur = sleepingProcs.head;
+        disk_request_ptr prev = NULL;
 
-        // Adding to the front of the queue
-        if (wakeTime < cur->wake_time)
-        {
-            Driver_Table[slot].nextAsleep = cur;
-            sleepingProcs.head = &Driver_Table[slot];
-        }
-        else // Adding anywhere but the front
+        mergedOne = 0;
+        for (disk_request_ptr cur = q->head; cur != NULL; prev = cur, cur = cur->next)
         {
-            while (wakeTime > cur->wake_time)
+            int curStart = reqStart(cur);
+            int curEnd = reqEnd(cur);
+            int fits;
+
+            if (cur->operation != first->operation || cur->num_sectors == 0)
             {
-                // This will cause adding to the end of the queue
-                if (cur->nextAsleep == NULL)
-                {
-                    break;
-                }
+                continue;
+            }
 
-                /* If the current proc has a lower wait time time than the
-                 * proc to be inserted, but the next proc has a higher wait time
-                 * than the proc to be inserted, we are in the right place.
-                 * This is where we break to add this slot in the queue
-                 */
-                if (wakeTime < cur->nextAsleep->wake_time)
-                {
-                    break;
-                }
+            if (first->operation == DISK_READ)
+                fits = curStart <= end && curEnd >= start;
+            else
+                fits = curStart == end || curEnd == start;
 
-                // advance if none of the above is true
-                cur = cur->nextAsleep;
+            if (!fits || firstConflict(q, cur, NULL) != NULL)
+            {
+                continue;
             }
 
-            driver_proc_ptr oldNext = cur->nextAsleep;
-            cur->nextAsleep = &Driver_Table[slot]; // insert the proc in the proper place
-            cur->nextAsleep->nextAsleep = oldNext;
+            // unlink it and chain it on
+            if (prev == NULL)
+                q->head = cur->next;
+            else
+                prev->next = cur->next;
+            if (q->tail == cur)
+                q->tail = prev;
+            cur->next = NULL;
+            cur->merged = NULL;
+            tail->merged = cur;
+            tail = cur;
+
+            start = curStart < start ? curStart : start;
+            end = curEnd > end ? curEnd : end;
+            q->merged_requests++;
+            mergedOne = 1;
+            break;
+        }
+    }
+
+    if (q->head == NULL)
+    {
+        q->hasProc = 0;
+    }
+}
+
+/* First sector of a request, counting from the start of the disk */
+static int reqStart(disk_request_ptr req)
+{
+    return linearSector(req->track_start, req->sector_start);
+}
+
+/* Sector just past the last one of a request */
+static int reqEnd(disk_request_ptr req)
+{
+    return reqStart(req) + req->num_sectors;
+}
+
+/*
+ * Returns the first request queued before req that shares a sector with
+ * it when either of them writes, and the request before that one in
+ * *prev if prev isn't NULL. Returns NULL if req may go first.
+ */
+static disk_request_ptr firstConflict(diskQueue *q, disk_request_ptr req, disk_request_ptr *prev)
+{
+    disk_request_ptr before = NULL;
+
+    for (disk_request_ptr cur = q->head; cur != req; before = cur, cur = cur->next)
+    {
+        if ((cur->operation == DISK_WRITE || req->operation == DISK_WRITE) &&
+            reqStart(cur) < reqEnd(req) && reqStart(req) < reqEnd(cur))
+        {
+            if (prev != NULL)
+            {
+                *prev = before;
+            }
+            return cur;
         }
     }
+
+    return NULL;
+}
+
+/* Where the sector at pos goes in the buffer of a request holding it */
+static char *sectorBuf(disk_request_ptr req, int pos)
+{
+    return (char *)req->disk_buf + (pos - reqStart(req)) * DISK_SECTOR_SIZE;
 }
 
 /*
- * Removes a sleeping proc from the sleep queue/
- * Returns the slot of the proc that was removed from the queue.
+ * Tells the requester that a request is done: V's the semaphore of a
+ * synchronous request, hands an async cache write back to the cache, or
+ * sends a diskCompletion to the mailbox of an
+ * async one and returns it to the pool. The completion goes into the
+ * slot submitAsync set aside, so the driver never blocks on or is
+ * refused by a full mailbox; only one released meanwhile loses it.
  */
-int removeFromSleepQueue()
+void completeDiskRequest(disk_request_ptr req)
 {
-    int removedSlot = 0;
-    driver_proc_ptr cur = sleepingProcs.head;
-    if (cur == NULL)
+    if (req->stage != -1)
     {
-        return -1; // Nothing to remove
+        stageComplete(req);
+        freeDiskRequest(req);
+        return;
     }
-    else if (cur->nextAsleep == NULL) // removing from a queue of length 1
+
+    if (req->block != NULL)
     {
-        removedSlot = sleepingProcs.head->slot;
-        sleepingProcs.head = NULL;
-        sleepingProcs.hasProc = 0;
-        return removedSlot;
+        cacheBlock *block = req->block;
+        int status = req->io_status;
+
+        // back to the pool first, the cacheMutex holder may be waiting for it
+        freeDiskRequest(req);
+        cacheWriteBackDone(block, status);
+        return;
     }
-    else // Removing from a queue with length greater than 1
+
+    if (req->mboxID == -1)
     {
-        driver_proc_ptr oldHead = cur;
-        sleepingProcs.head = oldHead->nextAsleep;
-        oldHead->nextAsleep = NULL;
-        removedSlot = oldHead->slot;
+        semv_real(req->doneSem); // Wake up the calling proc now that this has been handled
+        return;
     }
 
-    return removedSlot;
+    diskCompletion done;
+    done.handle = req->handle;
+    done.status = req->io_status;
+    done.bytes = req->sectors_read * DISK_SECTOR_SIZE;
+
+    if (MboxSendReserved(req->mboxID, req->reservation, &done, sizeof(done)) != 0)
+    {
+        requestPool.lostCompletions++;
+    }
+    freeDiskRequest(req);
 }
 
 /*
- * Adds a process to the disk queue according to track number.
- * This is a queue that is sorted lowest to highest based on track number.
- * The first argument is the slot in which the calling proc resides.
- * The second argument is the disk unit.
+ * Queues a request for the calling proc and blocks it until the disk
+ * driver is done. Returns the device status of the transfer, 0 on
+ * success. The proc waits on the request's own semaphore, so it can
+ * have other requests in flight and its Sleep semaphore is untouched.
  */
-void addToDiskQueue(int slot, int unit)
+int doDiskIO(int op, void *buf, int sectors, int track, int first, int unit)
 {
-    /* If this is the first proc being added to the queue, make it the head*/
-    if (diskRequests[unit].hasProc == 0)
+    disk_request_ptr req = newDiskRequest(op, buf, sectors, track, first, unit, 1);
+
+    startDiskIO(req);
+    return finishDiskIO(req);
+}
+
+/* Queues a request and wakes the driver of its unit */
+void startDiskIO(disk_request_ptr req)
+{
+    addToDiskQueue(req, req->unit);
+    semv_real(diskSemaphores[req->unit]); // wake up the disk driver
+}
+
+/*
+ * Blocks the calling proc until a request started with startDiskIO is
+ * done, then frees it. Returns its device status, 0 on success.
+ */
+int finishDiskIO(disk_request_ptr req)
+{
+    mark_disk_wait(1);
+    semp_real(req->doneSem); // block the calling proc till this is handled
+    mark_disk_wait(0);
+
+    int status = req->io_status;
+    freeDiskRequest(req);
+    return status;
+}
+
+/*
+ * Puts every request of the pool on the free list and gives each its
+ * completion semaphore.
+ */
+void initRequestPool()
+{
+    memset(&requestPool, 0, sizeof(requestPool));
+    requestPool.nextHandle = 1;
+    requestPool.waitSem = semcreate_real(0);
+
+    for (int i = DISK_REQUESTS - 1; i >= 0; i--)
     {
-        diskRequests[unit].head = &Driver_Table[slot];
-        diskRequests[unit].hasProc = 1;
+        requestPool.requests[i].doneSem = semcreate_real(0);
+        requestPool.requests[i].next = requestPool.freeList;
+        requestPool.freeList = &requestPool.requests[i];
     }
-    else
-    {
-        /* Otherwise, insert it into queue, but maintain sorted order (lowest to highest track)*/
-        int track = Driver_Table[slot].track_start;
-        driver_proc_ptr cur = diskRequests[unit].head;
+    requestPool.numFree = DISK_REQUESTS;
+}
 
-        // Adding to the front of the queue
-        if (track < cur->track_start)
+/*
+ * Takes a request from the pool and fills it in. If the pool is used
+ * up, blocks until a request is freed when wait is set and returns
+ * NULL otherwise.
+ */
+disk_request_ptr newDiskRequest(int op, void *buf, int sectors, int track, int first, int unit, int wait)
+{
+    semp_real(diskMutex);
+    while (requestPool.freeList == NULL)
+    {
+        if (!wait)
         {
-            Driver_Table[slot].nextDiskReq = cur;
-            diskRequests[unit].head = &Driver_Table[slot];
+            semv_real(diskMutex);
+            return NULL;
         }
-        else // Adding anywhere but the front
-        {
-            while (track > cur->track_start)
-            {
-                // This will cause adding to the end of the queue
-                if (cur->nextDiskReq == NULL)
-                {
-                    break;
-                }
-
-                /* If the current proc has a lower start track than the
-                 * proc to be inserted, but the next proc has a higher start track
-                 * than the proc to be inserted, we are in the right place.
-                 * This is where we break to add this slot in the queue
-                 */
-                if (track < cur->nextAsleep->track_start)
-                {
-                    break;
-                }
 
-                // advance if none of the above is true
-                cur = cur->nextDiskReq;
-            }
+        // backpressure, wait for freeDiskRequest to hand one back
+        requestPool.waiters++;
+        requestPool.poolWaits++;
+        semv_real(diskMutex);
+        semp_real(requestPool.waitSem);
+        semp_real(diskMutex);
+    }
+    disk_request_ptr req = requestPool.freeList;
+    requestPool.freeList = req->next;
+    requestPool.numFree--;
+    req->handle = requestPool.nextHandle++;
+    semv_real(diskMutex);
+
+    req->next = NULL;
+    req->operation = op;
+    req->disk_buf = buf;
+    req->num_sectors = sectors;
+    req->track_start = track;
+    req->sector_start = first;
+    req->unit = unit;
+    req->sectors_read = 0;
+    req->io_status = 0;
+    req->mboxID = -1;
+    req->stage = -1;
+    req->block = NULL;
+    req->merged = NULL;
+
+    return req;
+}
 
-            driver_proc_ptr oldNext = cur->nextDiskReq;
-            cur->nextDiskReq = &Driver_Table[slot]; // insert the proc in the proper place
-            cur->nextDiskReq->nextDiskReq = oldNext;
-        }
+/*
+ * Returns a request to the pool, waking a proc waiting for one.
+ */
+void freeDiskRequest(disk_request_ptr req)
+{
+    semp_real(diskMutex);
+    req->next = requestPool.freeList;
+    requestPool.freeList = req;
+    requestPool.numFree++;
+    if (requestPool.waiters > 0)
+    {
+        requestPool.waiters--;
+        semv_real(requestPool.waitSem);
     }
+    semv_real(diskMutex);
 }
 
 /*
- * This causes the head of the disk queue to be removed.
- * The argument is the disk unit.
+ * Moves the arm of the given disk unit to the given track, if it
+ * isn't already there.
  */
-void removeFromDiskQueue(int unit)
+void seekTo(int unit, int track)
 {
-    driver_proc_ptr cur = diskRequests[unit].head;
-    if (cur == NULL)
+    device_request dev_req;
+    int status;
+
+    if (track == diskRequests[unit].arm_track)
     {
-        return; // Nothing to remove
+        return;
     }
-    else if (cur->nextDiskReq == NULL) // removing from a queue of length 1
+
+    dev_req.opr = DISK_SEEK;
+    dev_req.reg1 = (void *)track;
+    device_output(DISK_DEV, unit, &dev_req);
+    waitdevice(DISK_DEV, unit, &status);
+    diskRequests[unit].device_ops++;
+
+    diskRequests[unit].total_seek_distance += trackDistance(diskRequests[unit].arm_track, track);
+    diskRequests[unit].arm_track = track;
+}
+
+/* Returns how many tracks apart two tracks are */
+int trackDistance(int from, int to)
+{
+    return from > to ? from - to : to - from;
+}
+
+/*
+ * Adds a process to the sleep queue. The argument should be the slot
+ * that the proc occupies in the Driver_Table array.
+ * The queue is a binary min-heap on wake_time, so this is O(log n).
+ */
+void addToSleepQueue(int slot)
+{
+    int i = sleepingProcs.size++;
+
+    sleepingProcs.heap[i] = &Driver_Table[slot];
+    Driver_Table[slot].heap_index = i;
+    siftUp(i);
+
+    // the first sleeper restarts an idle clock driver
+    if (tickless && sleepingProcs.size == 1)
     {
-        diskRequests[unit].head = NULL;
-        diskRequests[unit].hasProc = 0;
+        semv_real(clockSem);
     }
-    else // Removing from a queue with length greater than 1
+
+    // one due before the time the clock is programmed for moves it up
+    if (Driver_Table[slot].heap_index == 0)
     {
-        driver_proc_ptr oldHead = cur;
-        diskRequests[unit].head = oldHead->nextDiskReq;
-        oldHead->nextDiskReq = NULL;
+        clock_program(Driver_Table[slot].wake_time);
+    }
+}
+
+/*
+ * Removes the proc with the earliest wake time from the sleep queue.
+ * Returns the slot of the proc that was removed from the queue, or -1
+ * if the queue is empty.
+ */
+int removeFromSleepQueue()
+{
+    if (sleepingProcs.size == 0)
+    {
+        return -1; // Nothing to remove
+    }
+
+    int removedSlot = sleepingProcs.heap[0]->slot;
+    cancelSleep(removedSlot);
+    return removedSlot;
+}
+
+/*
+ * Takes the proc in the given Driver_Table slot out of the sleep queue
+ * without waking it. Does nothing if it isn't sleeping.
+ */
+void cancelSleep(int slot)
+{
+    int i = Driver_Table[slot].heap_index;
+
+    if (i < 0 || i >= sleepingProcs.size || sleepingProcs.heap[i] != &Driver_Table[slot])
+    {
+        return;
+    }
+
+    // move the last entry into the hole and restore the heap order
+    sleepingProcs.size--;
+    if (i != sleepingProcs.size)
+    {
+        sleepingProcs.heap[i] = sleepingProcs.heap[sleepingProcs.size];
+        sleepingProcs.heap[i]->heap_index = i;
+        siftUp(i);
+        siftDown(sleepingProcs.heap[i]->heap_index);
+    }
+    Driver_Table[slot].heap_index = -1;
+}
+
+/* Moves the heap entry at i up until its parent wakes no later */
+void siftUp(int i)
+{
+    driver_proc_ptr *heap = sleepingProcs.heap;
+
+    while (i > 0 && heap[(i - 1) / 2]->wake_time > heap[i]->wake_time)
+    {
+        int parent = (i - 1) / 2;
+        driver_proc_ptr temp = heap[parent];
+        heap[parent] = heap[i];
+        heap[i] = temp;
+        heap[i]->heap_index = i;
+        heap[parent]->heap_index = parent;
+        i = parent;
+    }
+}
+
+/* Moves the heap entry at i down until both children wake no earlier */
+void siftDown(int i)
+{
+    driver_proc_ptr *heap = sleepingProcs.heap;
+
+    while (1)
+    {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = 2 * i + 2;
+
+        if (left < sleepingProcs.size && heap[left]->wake_time < heap[smallest]->wake_time)
+            smallest = left;
+        if (right < sleepingProcs.size && heap[right]->wake_time < heap[smallest]->wake_time)
+            smallest = right;
+        if (smallest == i)
+            return;
+
+        driver_proc_ptr temp = heap[smallest];
+        heap[smallest] = heap[i];
+        heap[i] = temp;
+        heap[i]->heap_index = i;
+        heap[smallest]->heap_index = smallest;
+        i = smallest;
+    }
+}
+
+/*
+ * Adds a request to the end of the disk queue of the given unit. The
+ * order requests are served in is decided by removeFromDiskQueue.
+ */
+void addToDiskQueue(disk_request_ptr req, int unit)
+{
+    gettimeofday_real(&req->enqueue_time);
+    req->next = NULL;
+
+    semp_real(diskMutex);
+    if (diskRequests[unit].hasProc == 0)
+    {
+        diskRequests[unit].head = req;
+        diskRequests[unit].hasProc = 1;
+    }
+    else
+    {
+        diskRequests[unit].tail->next = req;
+    }
+    diskRequests[unit].tail = req;
+    semv_real(diskMutex);
+    TRACE(TRACE_DISK_ENQUEUE, unit, req->track_start);
+}
+
+/*
+ * Picks the next request for the given disk unit according to the
+ * unit's scheduling policy and removes it from the queue. A request
+ * doesn't pass an earlier one for any of the same sectors when either
+ * of them writes; the earlier one goes first instead.
+ * Returns NULL if the queue is empty.
+ */
+disk_request_ptr removeFromDiskQueue(int unit)
+{
+    diskQueue *q = &diskRequests[unit];
+    disk_request_ptr best = NULL;
+    disk_request_ptr bestPrev = NULL;
+    disk_request_ptr prev = NULL;
+    disk_request_ptr lowest = NULL;
+    disk_request_ptr lowestPrev = NULL;
+    disk_request_ptr earlier;
+    disk_request_ptr earlierPrev;
+
+    if (!q->hasProc)
+    {
+        return NULL; // Nothing to remove
+    }
+
+    if (q->policy == DISK_SCHED_FCFS)
+    {
+        best = q->head;
+    }
+    else
+    {
+        for (disk_request_ptr cur = q->head; cur != NULL; prev = cur, cur = cur->next)
+        {
+            int track = cur->track_start;
+
+            if (lowest == NULL || track < lowest->track_start)
+            {
+                lowest = cur;
+                lowestPrev = prev;
+            }
+
+            if (q->policy == DISK_SCHED_SSTF)
+            {
+                if (best == NULL || trackDistance(q->arm_track, track) <
+                                        trackDistance(q->arm_track, best->track_start))
+                {
+                    best = cur;
+                    bestPrev = prev;
+                }
+            }
+            else if (q->policy == DISK_SCHED_SCAN && q->direction < 0)
+            {
+                // closest request at or below the arm
+                if (track <= q->arm_track && (best == NULL || track > best->track_start))
+                {
+                    best = cur;
+                    bestPrev = prev;
+                }
+            }
+            else
+            {
+                // SCAN going up and C-SCAN: closest request at or above the arm
+                if (track >= q->arm_track && (best == NULL || track < best->track_start))
+                {
+                    best = cur;
+                    bestPrev = prev;
+                }
+            }
+        }
+
+        if (best == NULL && q->policy == DISK_SCHED_CSCAN)
+        {
+            // nothing left above the arm, wrap around to the lowest track
+            best = lowest;
+            bestPrev = lowestPrev;
+        }
+        else if (best == NULL)
+        {
+            // SCAN hit the end of its sweep, turn around and try again
+            q->direction = -q->direction;
+            return removeFromDiskQueue(unit);
+        }
+    }
+
+    // the earliest request is never held back, so this ends
+    while ((earlier = firstConflict(q, best, &earlierPrev)) != NULL)
+    {
+        best = earlier;
+        bestPrev = earlierPrev;
+    }
+
+    // unlink the chosen request
+    if (bestPrev == NULL)
+        q->head = best->next;
+    else
+        bestPrev->next = best->next;
+
+    if (q->tail == best)
+        q->tail = bestPrev;
+
+    best->next = NULL;
+    if (q->head == NULL)
+    {
+        q->hasProc = 0;
+    }
+
+    mergeRequests(q, best);
+    return best;
+}
+
+/*
+ * Prints the seek distance and request latency of each disk unit.
+ */
+void dump_disk_stats()
+{
+    for (int unit = 0; unit < DISK_UNITS; unit++)
+    {
+        diskQueue *q = &diskRequests[unit];
+
+        console("DISK UNIT: %d \n", unit);
+        console("SCHED POLICY: %d \n", q->policy);
+        console("REQUESTS SERVED: %d \n", q->requests_served);
+        console("MERGED REQUESTS: %d \n", q->merged_requests);
+        console("DEVICE OPS: %ld \n", q->device_ops);
+        console("TOTAL SEEK DISTANCE: %ld \n", q->total_seek_distance);
+        if (q->requests_served > 0)
+        {
+            console("DEVICE OPS PER REQUEST (x100): %ld \n", q->device_ops * 100 / q->requests_served);
+            console("AVG SEEK DISTANCE: %ld \n", q->total_seek_distance / q->requests_served);
+            console("AVG LATENCY (us): %ld \n", q->total_latency / q->requests_served);
+        }
+        console("--------------------------------------- \n");
+    }
+    console("FREE DISK REQUESTS: %d of %d \n", requestPool.numFree, DISK_REQUESTS);
+    console("LOST ASYNC COMPLETIONS: %d \n", requestPool.lostCompletions);
+    console("WAITS FOR A FREE REQUEST: %d \n", requestPool.poolWaits);
+}
+
+/*
+ * Prints how often the clock driver woke up to poll the clock and how
+ * many clock and disk interrupts the machine took, with the rates since
+ * the driver started.
+ */
+void dump_clock_stats()
+{
+    int now;
+    gettimeofday_real(&now);
+    int elapsedSecs = (now - clockStartTime) / 1000000;
+
+    console("TICKLESS: %d \n", tickless);
+    console("CLOCK DRIVER WAKEUPS: %d \n", clockWakeups);
+    console("INTERRUPTS: %d \n", interrupt_count());
+    if (elapsedSecs > 0)
+    {
+        console("CLOCK DRIVER WAKEUPS PER SEC: %d \n", clockWakeups / elapsedSecs);
+        console("INTERRUPTS PER SEC: %d \n", interrupt_count() / elapsedSecs);
+    }
+    console("--------------------------------------- \n");
+}
+
+/*
+ * Pointed to by the syscall vector for DiskCacheStats. Copies the
+ * buffer cache counters into the diskCacheStats arg1 points to.
+ */
+void disk_cache_stats_sys(sysargs *pArgs)
+{
+    diskCacheStats *out = pArgs->arg1;
+
+    if (out == NULL)
+    {
+        pArgs->arg4 = -1;
+        return;
+    }
+
+    semp_real(statsMutex);
+    *out = diskCache.stats;
+    semv_real(statsMutex);
+    pArgs->arg4 = 0;
+}
+
+/*
+ * Empties the buffer cache. cacheCapacity is capped at CACHE_MAX_BLOCKS.
+ */
+void initCache()
+{
+    memset(&diskCache, 0, sizeof(diskCache));
+    if (cacheCapacity > CACHE_MAX_BLOCKS)
+    {
+        cacheCapacity = CACHE_MAX_BLOCKS;
+    }
+    for (int i = 0; i < CACHE_HASH_SIZE; i++)
+    {
+        diskCache.hashHeads[i] = -1;
+    }
+    diskCache.busySem = semcreate_real(0);
+    diskCache.stats.capacity = cacheCapacity;
+}
+
+/*
+ * Moves track and sector on to the sector after them, wrapping to the
+ * next track the same way handleDiskTransfer does.
+ */
+void nextSector(int unit, int *track, int *sector)
+{
+    if (++*sector >= DISK_TRACK_SIZE)
+    {
+        *sector = 0;
+        *track = (*track + 1) % num_tracks[unit];
+    }
+}
+
+/* Hash chain a sector of the cache lives on */
+static int cacheHash(int unit, int track, int sector)
+{
+    return ((track * DISK_TRACK_SIZE + sector) * DISK_UNITS + unit) % CACHE_HASH_SIZE;
+}
+
+/*
+ * Returns the cached block of a sector, or NULL if it isn't cached.
+ * A dropped block waiting for its write back doesn't count.
+ * The caller holds cacheMutex.
+ */
+cacheBlock *cacheLookup(int unit, int track, int sector)
+{
+    for (int i = diskCache.hashHeads[cacheHash(unit, track, sector)]; i != -1; i = diskCache.blocks[i].hashNext)
+    {
+        cacheBlock *block = &diskCache.blocks[i];
+
+        if (block->unit == unit && block->track == track && block->sector == sector &&
+            !block->dropped)
+        {
+            return block;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Takes the given block off its hash chain and marks it free.
+ */
+void cacheUnhash(cacheBlock *block)
+{
+    int index = block - diskCache.blocks;
+    int *link = &diskCache.hashHeads[cacheHash(block->unit, block->track, block->sector)];
+
+    while (*link != index)
+    {
+        link = &diskCache.blocks[*link].hashNext;
+    }
+    *link = block->hashNext;
+
+    if (block->dirty)
+    {
+        countStat(&diskCache.stats.dirty, -1);
+    }
+    block->valid = 0;
+    block->dirty = 0;
+}
+
+/*
+ * Writes a dirty block back to disk together with the dirty sectors
+ * cached right after it, as one run of up to CACHE_RUN_MAX sectors. The
+ * caller holds cacheMutex. The write is queued before it is dropped, so
+ * a transfer that finds the blocks busy is queued behind it, and it is
+ * taken again once the device is done. A block written to meanwhile is
+ * dirty again when the write back is done. Returns the device status of
+ * the write, 0 if the block was cleaned by someone else while waiting
+ * for a disk request; the blocks are dirty again if it failed.
+ */
+int writeBack(cacheBlock *block)
+{
+    cacheBlock *run[CACHE_RUN_MAX];
+    char data[CACHE_RUN_MAX * DISK_SECTOR_SIZE];
+    disk_request_ptr req;
+    int count = 0;
+    int unit = block->unit;
+    int t = block->track;
+    int s = block->sector;
+
+    if (cacheRequest(&req) && !(block->valid && block->dirty && !block->busy))
+    {
+        freeDiskRequest(req);
+        return 0;
+    }
+
+    // copy the run out, so writes to it can go on while it is on the way
+    while (count < CACHE_RUN_MAX && block != NULL && block->dirty && !block->busy)
+    {
+        memcpy(data + count * DISK_SECTOR_SIZE, block->data, DISK_SECTOR_SIZE);
+        block->busy = 1;
+        block->dirty = 0;
+        run[count++] = block;
+
+        // the run can't wrap from the last track back to the first
+        nextSector(unit, &t, &s);
+        block = t == 0 && s == 0 ? NULL : cacheLookup(unit, t, s);
+    }
+    countStat(&diskCache.stats.dirty, -count);
+
+    req->disk_buf = data;
+    req->num_sectors = count;
+    req->track_start = run[0]->track;
+    req->sector_start = run[0]->sector;
+    req->unit = unit;
+    startDiskIO(req);
+
+    semv_real(cacheMutex);
+    int status = finishDiskIO(req);
+    semp_real(cacheMutex);
+
+    writeBackDone(run, count, status);
+    return status;
+}
+
+/*
+ * Gets a disk request for a write back. The caller holds cacheMutex,
+ * which is dropped if the pool is used up: a driver finishing an async
+ * write back frees its request and then takes the mutex. Returns 1 if
+ * the mutex was dropped, so the cache may have changed meanwhile.
+ */
+static int cacheRequest(disk_request_ptr *req)
+{
+    *req = newDiskRequest(DISK_WRITE, NULL, 0, 0, 0, 0, 0);
+    if (*req != NULL)
+    {
+        return 0;
+    }
+
+    semv_real(cacheMutex);
+    *req = newDiskRequest(DISK_WRITE, NULL, 0, 0, 0, 0, 1);
+    semp_real(cacheMutex);
+    return 1;
+}
+
+/*
+ * Finishes a write back of the given blocks with cacheMutex held. They
+ * are no longer busy, dirty again if the write failed and they weren't
+ * written to meanwhile, and freed if an async write dropped them. Procs
+ * waiting for a busy block are woken.
+ */
+static void writeBackDone(cacheBlock **run, int count, int status)
+{
+    for (int i = 0; i < count; i++)
+    {
+        run[i]->busy = 0;
+        if (run[i]->dropped)
+        {
+            run[i]->dropped = 0;
+            cacheUnhash(run[i]);
+        }
+        else if (status != 0 && !run[i]->dirty)
+        {
+            run[i]->dirty = 1;
+            countStat(&diskCache.stats.dirty, 1);
+        }
+    }
+    if (status == 0)
+    {
+        countStat(&diskCache.stats.writebacks, count);
+    }
+
+    // procs waiting for a busy block look again
+    while (diskCache.busyWaiters > 0)
+    {
+        diskCache.busyWaiters--;
+        semv_real(diskCache.busySem);
+    }
+}
+
+/*
+ * Called by the disk driver when an async write back queued by
+ * cacheQueueWriteBacks is done.
+ */
+void cacheWriteBackDone(cacheBlock *block, int status)
+{
+    semp_real(cacheMutex);
+    writeBackDone(&block, 1, status);
+    semv_real(cacheMutex);
+}
+
+/*
+ * Waits for a write back in flight to finish. The caller holds
+ * cacheMutex, which is dropped while it waits and taken again.
+ */
+static void cacheWaitBusy()
+{
+    diskCache.busyWaiters++;
+    semv_real(cacheMutex);
+    semp_real(diskCache.busySem);
+    semp_real(cacheMutex);
+}
+
+/*
+ * Makes room when cacheAlloc finds every block dirty or busy: writes
+ * back the run of the first dirty block at or after the CLOCK hand, or
+ * waits for a write back in flight if no block is dirty. The caller
+ * holds cacheMutex, which is dropped meanwhile. Returns the device
+ * status of the write back, 0 if there was none.
+ */
+static int cacheClean()
+{
+    for (int i = 0; i < cacheCapacity; i++)
+    {
+        cacheBlock *block = &diskCache.blocks[(diskCache.hand + i) % cacheCapacity];
+
+        if (block->valid && block->dirty && !block->busy)
+        {
+            return writeBack(block);
+        }
+    }
+
+    cacheWaitBusy();
+    return 0;
+}
+
+/*
+ * Finds a block for a sector that isn't cached, evicting with the CLOCK
+ * algorithm: the hand skips blocks used since it last passed, clearing
+ * their bit, and takes the first one that wasn't. Dirty and busy blocks
+ * are never taken, so this doesn't do I/O. Returns NULL if the hand
+ * went around twice without finding one. The caller holds cacheMutex.
+ */
+cacheBlock *cacheAlloc(int unit, int track, int sector)
+{
+    cacheBlock *block = NULL;
+
+    // the first time around may only clear second chance bits
+    for (int i = 0; block == NULL && i < 2 * cacheCapacity; i++)
+    {
+        cacheBlock *cur = &diskCache.blocks[diskCache.hand];
+        diskCache.hand = (diskCache.hand + 1) % cacheCapacity;
+
+        if (!cur->valid)
+        {
+            block = cur;
+        }
+        else if (cur->referenced)
+        {
+            cur->referenced = 0; // second chance
+        }
+        else if (!cur->dirty && !cur->busy)
+        {
+            cacheUnhash(cur);
+            countStat(&diskCache.stats.evictions, 1);
+            block = cur;
+        }
+    }
+
+    if (block == NULL)
+    {
+        return NULL;
+    }
+
+    int chain = cacheHash(unit, track, sector);
+    block->valid = 1;
+    block->dirty = 0;
+    block->referenced = 1;
+    block->unit = unit;
+    block->track = track;
+    block->sector = sector;
+    block->hashNext = diskCache.hashHeads[chain];
+    diskCache.hashHeads[chain] = block - diskCache.blocks;
+
+    return block;
+}
+
+/*
+ * Copies a run of sectors out of the cache into buf if every one of
+ * them is cached. Returns 1 if it did, 0 if the run has to go to disk;
+ * buf may then hold some of the sectors, which the read overwrites.
+ */
+int cacheRead(char *buf, int sectors, int track, int first, int unit)
+{
+    if (cacheCapacity == 0)
+    {
+        return 0;
+    }
+
+    semp_real(cacheMutex);
+    int t = track;
+    int s = first;
+    for (int i = 0; i < sectors; i++, nextSector(unit, &t, &s))
+    {
+        cacheBlock *block = cacheLookup(unit, t, s);
+
+        if (block == NULL)
+        {
+            countStat(&diskCache.stats.misses, 1);
+            semv_real(cacheMutex);
+            return 0;
+        }
+        memcpy(buf + i * DISK_SECTOR_SIZE, block->data, DISK_SECTOR_SIZE);
+        block->referenced = 1;
+    }
+    countStat(&diskCache.stats.hits, 1);
+    semv_real(cacheMutex);
+
+    return 1;
+}
+
+/*
+ * Called after a run of sectors was read from disk into buf. Sectors
+ * that are already cached may be newer than the disk, so their cached
+ * copy is put into buf; the rest are added to the cache if a clean block
+ * can be had. Runs too big for the cache are not added.
+ */
+void cacheFill(char *buf, int sectors, int track, int first, int unit)
+{
+    if (cacheCapacity == 0)
+    {
+        return;
+    }
+
+    semp_real(cacheMutex);
+    int t = track;
+    int s = first;
+    for (int i = 0; i < sectors; i++, nextSector(unit, &t, &s))
+    {
+        char *data = buf + i * DISK_SECTOR_SIZE;
+        cacheBlock *block = cacheLookup(unit, t, s);
+
+        if (block != NULL)
+        {
+            memcpy(data, block->data, DISK_SECTOR_SIZE);
+            block->referenced = 1;
+        }
+        else if (sectors <= cacheCapacity / 2 && (block = cacheAlloc(unit, t, s)) != NULL)
+        {
+            memcpy(block->data, data, DISK_SECTOR_SIZE);
+        }
+    }
+    semv_real(cacheMutex);
+}
+
+/*
+ * Writes a run of sectors into the cache, leaving them dirty for the
+ * flusher. If every block is dirty or busy some are written back first.
+ * Returns 0, or the status of a failed write back; sectors after the
+ * failure were not written.
+ */
+int cacheWrite(char *buf, int sectors, int track, int first, int unit)
+{
+    int status = 0;
+
+    semp_real(cacheMutex);
+    int wasClean = diskCache.stats.dirty == 0; // the flusher is idle
+    int t = track;
+    int s = first;
+    for (int i = 0; i < sectors; i++, nextSector(unit, &t, &s))
+    {
+        cacheBlock *block = cacheLookup(unit, t, s);
+
+        while (block == NULL && (block = cacheAlloc(unit, t, s)) == NULL &&
+               (status = cacheClean()) == 0)
+        {
+            block = cacheLookup(unit, t, s); // cached while the mutex was dropped?
+        }
+        if (block == NULL)
+        {
+            break;
+        }
+
+        memcpy(block->data, buf + i * DISK_SECTOR_SIZE, DISK_SECTOR_SIZE);
+        block->referenced = 1;
+        if (!block->dirty)
+        {
+            block->dirty = 1;
+            countStat(&diskCache.stats.dirty, 1);
+        }
+    }
+    if (wasClean && diskCache.stats.dirty > 0)
+    {
+        semv_real(flushSem); // wake the flusher
+    }
+    semv_real(cacheMutex);
+
+    return status;
+}
+
+/*
+ * Gets the cache out of the way of a transfer that bypasses it. Dirty
+ * sectors in the run are written back so the disk is current, and if
+ * drop is set the run's sectors are then removed from the cache since
+ * the transfer will overwrite them. Write backs in flight for the run
+ * are waited for, so they can't land after the transfer.
+ */
+void cacheSyncRange(int sectors, int track, int first, int unit, int drop)
+{
+    if (cacheCapacity == 0)
+    {
+        return;
+    }
+
+    semp_real(cacheMutex);
+    int t = track;
+    int s = first;
+    int i = 0;
+    while (i < sectors)
+    {
+        cacheBlock *block = cacheLookup(unit, t, s);
+
+        if (block != NULL && block->busy)
+        {
+            cacheWaitBusy();
+            continue; // the mutex was dropped, look again
+        }
+        if (block != NULL && drop)
+        {
+            cacheUnhash(block);
+        }
+        else if (block != NULL && block->dirty)
+        {
+            writeBack(block); // also takes the dirty sectors after it
+        }
+        i++;
+        nextSector(unit, &t, &s);
+    }
+    semv_real(cacheMutex);
+}
+
+/*
+ * Queues a write back of every dirty sector in a run, for an async read
+ * of it, without waiting for any of them. Each goes straight from its
+ * block, which stays busy until the driver is done with it; the disk
+ * queue keeps the read behind them, and behind write backs already in
+ * flight for the run.
+ */
+void cacheQueueWriteBacks(int sectors, int track, int first, int unit)
+{
+    disk_request_ptr req = NULL;
+
+    if (cacheCapacity == 0)
+    {
+        return;
+    }
+
+    semp_real(cacheMutex);
+    int t = track;
+    int s = first;
+    int i = 0;
+    while (i < sectors)
+    {
+        cacheBlock *block = cacheLookup(unit, t, s);
+
+        if (block != NULL && block->dirty && !block->busy)
+        {
+            if (req == NULL && cacheRequest(&req))
+            {
+                continue; // the mutex was dropped, look again
+            }
+
+            block->busy = 1;
+            block->dirty = 0;
+            countStat(&diskCache.stats.dirty, -1);
+
+            req->disk_buf = block->data;
+            req->num_sectors = 1;
+            req->track_start = t;
+            req->sector_start = s;
+            req->unit = unit;
+            req->block = block;
+            startDiskIO(req);
+            req = NULL;
+        }
+        i++;
+        nextSector(unit, &t, &s);
+    }
+    semv_real(cacheMutex);
+
+    if (req != NULL)
+    {
+        freeDiskRequest(req);
+    }
+}
+
+/*
+ * Removes a run an async write will overwrite from the cache without
+ * waiting. A block with a write back in flight is marked dropped
+ * instead: lookups pass it by, and it is freed once the write back,
+ * which the disk queue keeps ahead of the async write, is done.
+ */
+void cacheDropRange(int sectors, int track, int first, int unit)
+{
+    if (cacheCapacity == 0)
+    {
+        return;
+    }
+
+    semp_real(cacheMutex);
+    int t = track;
+    int s = first;
+    for (int i = 0; i < sectors; i++, nextSector(unit, &t, &s))
+    {
+        cacheBlock *block = cacheLookup(unit, t, s);
+
+        if (block == NULL)
+        {
+            continue;
+        }
+        if (!block->busy)
+        {
+            cacheUnhash(block);
+            continue;
+        }
+
+        if (block->dirty)
+        {
+            block->dirty = 0;
+            countStat(&diskCache.stats.dirty, -1);
+        }
+        block->dropped = 1;
+    }
+    semv_real(cacheMutex);
+}
+
+/*
+ * Adds delta to one of the diskCache.stats counters. They are bumped
+ * under cacheMutex by the cache and under diskMutex by the read-ahead,
+ * so a lock of their own keeps them and the DiskCacheStats copy
+ * consistent. Nothing else is ever taken while it is held.
+ */
+static void countStat(int *counter, int delta)
+{
+    semp_real(statsMutex);
+    *counter += delta;
+    semv_real(statsMutex);
+}
+
+/*
+ * Returns 1 if the sector before block is cached, dirty and not busy,
+ * so a write back starting there takes block along.
+ */
+static int midRun(cacheBlock *block)
+{
+    int t = block->track;
+    int s = block->sector - 1;
+
+    if (s < 0)
+    {
+        if (t == 0)
+        {
+            return 0;
+        }
+        t--;
+        s = DISK_TRACK_SIZE - 1;
+    }
+
+    cacheBlock *prev = cacheLookup(block->unit, t, s);
+    return prev != NULL && prev->dirty && !prev->busy;
+}
+
+/*
+ * Writes every dirty sector of the cache back to disk, each run of
+ * consecutive dirty sectors as one write starting at its first sector.
+ * Writes that come in while cacheMutex is dropped for the device can
+ * dirty blocks the scan already passed, so it goes around again until
+ * the cache is clean or a pass gets nothing written.
+ */
+void flushCache()
+{
+    int wrote = 1;
+
+    semp_real(cacheMutex);
+    while (wrote && diskCache.stats.dirty > 0)
+    {
+        wrote = 0;
+        for (int i = 0; i < cacheCapacity && diskCache.stats.dirty > 0; i++)
+        {
+            cacheBlock *block = &diskCache.blocks[i];
+
+            if (block->valid && block->dirty && !block->busy && !midRun(block) &&
+                writeBack(block) == 0)
+            {
+                wrote = 1;
+            }
+        }
+    }
+    semv_real(cacheMutex);
+}
+
+/*
+ * Frees every read-ahead stage.
+ */
+void initReadAhead()
+{
+    for (int i = 0; i < RA_STAGES; i++)
+    {
+        memset(&raStages[i], 0, sizeof(raStages[i]));
+        raStages[i].owner = -1;
+        raStages[i].sem = semcreate_real(0);
+    }
+}
+
+/* Position of a sector counting from the start of the disk */
+static int linearSector(int track, int sector)
+{
+    return track * DISK_TRACK_SIZE + sector;
+}
+
+/* 1 if the run of sectors lies inside what the stage holds or will hold */
+static int stageCovers(raStage *stage, int sectors, int track, int first, int unit)
+{
+    int start = linearSector(track, first);
+    int stageStart = linearSector(stage->track, stage->sector);
+
+    return (stage->valid || stage->pending) && !stage->stale && stage->unit == unit &&
+           start >= stageStart && start + sectors <= stageStart + stage->count;
+}
+
+/*
+ * Copies a run of sectors out of a read-ahead stage into buf if one
+ * holds all of them, waiting for the stage if the device is still
+ * filling it. Returns 1 if it did, 0 if the run has to go to disk.
+ */
+int readAheadHit(char *buf, int sectors, int track, int first, int unit)
+{
+    semp_real(diskMutex);
+    for (int i = 0; i < RA_STAGES; i++)
+    {
+        raStage *stage = &raStages[i];
+
+        if (!stageCovers(stage, sectors, track, first, unit))
+        {
+            continue;
+        }
+
+        if (stage->pending)
+        {
+            stage->waiters++;
+            semv_real(diskMutex);
+            semp_real(stage->sem);
+            semp_real(diskMutex);
+            if (!stageCovers(stage, sectors, track, first, unit) || !stage->valid)
+            {
+                break; // the read failed or a write got in first
+            }
+        }
+
+        int offset = linearSector(track, first) - linearSector(stage->track, stage->sector);
+        memcpy(buf, stage->data + offset * DISK_SECTOR_SIZE, sectors * DISK_SECTOR_SIZE);
+        stage->used = 1;
+        countStat(&diskCache.stats.raHits, 1);
+        semv_real(diskMutex);
+        return 1;
+    }
+    semv_real(diskMutex);
+
+    return 0;
+}
+
+/*
+ * Called after a successful DiskRead by the proc in the given
+ * Driver_Table slot. A read starting where the proc's last read on the
+ * unit ended continues a sequential stream: its window grows while
+ * reads hit the read-ahead, and once the stream's stage holds nothing
+ * past this read the next window is read ahead. Any other read resets
+ * the stream.
+ */
+void updateStream(int slot, int unit, int sectors, int track, int first, int stageHit)
+{
+    raStream *stream = &Driver_Table[slot].streams[unit];
+    int sequential = track == stream->next_track && first == stream->next_sector;
+
+    // find where this read ended
+    for (int i = 0; i < sectors; i++)
+    {
+        nextSector(unit, &track, &first);
+    }
+    stream->next_track = track;
+    stream->next_sector = first;
+
+    if (!sequential)
+    {
+        stream->window = RA_MIN_WINDOW;
+        if (stream->stage != -1)
+        {
+            semp_real(diskMutex);
+            raStages[stream->stage].owner = -1; // let another stream have it
+            semv_real(diskMutex);
+            stream->stage = -1;
+        }
+        return;
+    }
+
+    if (stageHit && stream->window < RA_MAX_WINDOW)
+    {
+        stream->window *= 2;
+    }
+
+    if (stream->stage == -1 || !stageCovers(&raStages[stream->stage], 1, track, first, unit))
+    {
+        readAhead(slot, unit);
+    }
+}
+
+/*
+ * Queues an async read of the next window of the stream of the proc in
+ * the given Driver_Table slot into a staging buffer. Does nothing if no
+ * stage is free or the stream's stage is still being filled.
+ */
+void readAhead(int slot, int unit)
+{
+    raStream *stream = &Driver_Table[slot].streams[unit];
+    raStage *stage = NULL;
+
+    // reads past the last track would wrap, stop the window there
+    int left = linearSector(num_tracks[unit], 0) - linearSector(stream->next_track, stream->next_sector);
+    int count = stream->window < left ? stream->window : left;
+    if (count <= 0)
+    {
+        return;
+    }
+
+    semp_real(diskMutex);
+    if (stream->stage != -1 && raStages[stream->stage].owner == slot)
+    {
+        stage = &raStages[stream->stage];
+    }
+    for (int i = 0; stage == NULL && i < RA_STAGES; i++)
+    {
+        if (raStages[i].owner == -1 && !raStages[i].pending)
+        {
+            stage = &raStages[i];
+        }
+    }
+
+    if (stage == NULL || stage->pending)
+    {
+        semv_real(diskMutex);
+        return;
+    }
+
+    if (stage->valid && !stage->used)
+    {
+        countStat(&diskCache.stats.raWasted, 1);
+    }
+    stage->owner = slot;
+    stage->pending = 1;
+    stage->valid = 0;
+    stage->stale = 0;
+    stage->used = 0;
+    stage->unit = unit;
+    stage->track = stream->next_track;
+    stage->sector = stream->next_sector;
+    stage->count = count;
+    stream->stage = stage - raStages;
+    semv_real(diskMutex);
+
+    disk_request_ptr req = newDiskRequest(DISK_READ, stage->data, count, stage->track, stage->sector, unit, 0);
+    if (req == NULL)
+    {
+        semp_real(diskMutex);
+        stage->pending = 0; // no request free, skip this read-ahead
+        semv_real(diskMutex);
+        return;
+    }
+    req->stage = stream->stage;
+
+    countStat(&diskCache.stats.raIssued, 1);
+    addToDiskQueue(req, unit);
+    semv_real(diskSemaphores[unit]); // wake up the disk driver
+}
+
+/*
+ * Called by the disk driver when a read-ahead request is done. Marks
+ * the stage filled, unless the read failed or a write overlapped it,
+ * and wakes the readers waiting for it.
+ */
+void stageComplete(disk_request_ptr req)
+{
+    raStage *stage = &raStages[req->stage];
+
+    semp_real(diskMutex);
+    stage->pending = 0;
+    stage->valid = req->io_status == 0 && !stage->stale;
+    int waiters = stage->waiters;
+    stage->waiters = 0;
+    semv_real(diskMutex);
+
+    while (waiters-- > 0)
+    {
+        semv_real(stage->sem);
+    }
+}
+
+/*
+ * Drops every read-ahead stage that overlaps a run of sectors about to
+ * be written, so no later read is served the old data.
+ */
+void raInvalidate(int sectors, int track, int first, int unit)
+{
+    int start = linearSector(track, first);
+
+    semp_real(diskMutex);
+    for (int i = 0; i < RA_STAGES; i++)
+    {
+        raStage *stage = &raStages[i];
+        int stageStart = linearSector(stage->track, stage->sector);
+
+        if ((stage->valid || stage->pending) && stage->unit == unit &&
+            start < stageStart + stage->count && stageStart < start + sectors)
+        {
+            if (stage->valid && !stage->used)
+            {
+                countStat(&diskCache.stats.raWasted, 1);
+            }
+            stage->valid = 0;
+            stage->stale = stage->pending;
+        }
     }
+    semv_real(diskMutex);
 }
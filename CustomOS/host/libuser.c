@@ -0,0 +1,277 @@
+/* ------------------------------------------------------------------------
+   libuser.c
+
+   User mode system call wrappers. Each packs its arguments into a
+   sysargs the way the handler in phase 3 or 4 unpacks them and raises
+   the syscall interrupt with usyscall.
+   ------------------------------------------------------------------------ */
+#include <usloss.h>
+#include <usyscall.h>
+#include <libuser.h>
+#include <processManager.h>
+#include "sems.h"
+#include "driver.h"
+
+#define CHECKMODE                                                     \
+   {                                                                  \
+      if (psr_get() & PSR_CURRENT_MODE)                               \
+      {                                                               \
+         console("Trying to invoke syscall from kernel.  Halting\n"); \
+         halt(1);                                                     \
+      }                                                               \
+   }
+
+int Spawn(char *name, int (*func)(char *), char *arg, int stack_size,
+          int priority, int *pid)
+{
+   sysargs sa;
+
+   CHECKMODE;
+   sa.number = SYS_SPAWN;
+   sa.arg1 = (void *)func;
+   sa.arg2 = arg;
+   sa.arg3 = (void *)(long)stack_size;
+   sa.arg4 = (void *)(long)priority;
+   sa.arg5 = name;
+   usyscall(&sa);
+   *pid = (int)(long)sa.arg1;
+   return (int)(long)sa.arg4;
+}
+
+/* Returns 0, or -1 for bad arguments. *created may be less than
+ * args->count if the process table filled up. */
+int SpawnMany(struct SpawnManyArgs *args, int *created)
+{
+   sysargs sa;
+
+   CHECKMODE;
+   sa.number = SYS_SPAWNMANY;
+   sa.arg1 = args;
+   usyscall(&sa);
+   *created = (int)(long)sa.arg1;
+   return (int)(long)sa.arg4;
+}
+
+/* Returns 0, or -1 if the caller has no children to wait for */
+int Wait(int *pid, int *status)
+{
+   sysargs sa;
+
+   CHECKMODE;
+   sa.number = SYS_WAIT;
+   usyscall(&sa);
+   *pid = (int)(long)sa.arg1;
+   *status = (int)(long)sa.arg2;
+   return (int)(long)sa.arg4;
+}
+
+void Terminate(int status)
+{
+   sysargs sa;
+
+   CHECKMODE;
+   sa.number = SYS_TERMINATE;
+   sa.arg1 = (void *)(long)status;
+   usyscall(&sa);
+}
+
+int SemCreate(int value, int *semaphore)
+{
+   sysargs sa;
+
+   CHECKMODE;
+   sa.number = SYS_SEMCREATE;
+   sa.arg1 = (void *)(long)value;
+   usyscall(&sa);
+   *semaphore = (int)(long)sa.arg1;
+   return (int)(long)sa.arg4;
+}
+
+/* Returns 0, -1 if there is no such semaphore or it was freed while
+ * waiting, -3 if zapped while waiting */
+int SemP(int semaphore)
+{
+   sysargs sa;
+
+   CHECKMODE;
+   sa.number = SYS_SEMP;
+   sa.arg1 = (void *)(long)semaphore;
+   usyscall(&sa);
+   return (int)(long)sa.arg4;
+}
+
+int SemV(int semaphore)
+{
+   sysargs sa;
+
+   CHECKMODE;
+   sa.number = SYS_SEMV;
+   sa.arg1 = (void *)(long)semaphore;
+   usyscall(&sa);
+   return (int)(long)sa.arg4;
+}
+
+/* Returns 0, 1 if procs were blocked on it, or -1 */
+int SemFree(int semaphore)
+{
+   sysargs sa;
+
+   CHECKMODE;
+   sa.number = SYS_SEMFREE;
+   sa.arg1 = (void *)(long)semaphore;
+   usyscall(&sa);
+   return (int)(long)sa.arg4;
+}
+
+void GetTimeofDay(int *tod)
+{
+   sysargs sa;
+
+   CHECKMODE;
+   sa.number = SYS_GETTIMEOFDAY;
+   usyscall(&sa);
+   *tod = (int)(long)sa.arg1;
+}
+
+void CPUTime(int *cpu)
+{
+   sysargs sa;
+
+   CHECKMODE;
+   sa.number = SYS_CPUTIME;
+   usyscall(&sa);
+   *cpu = (int)(long)sa.arg1;
+}
+
+void GetPID(int *pid)
+{
+   sysargs sa;
+
+   CHECKMODE;
+   sa.number = SYS_GETPID;
+   usyscall(&sa);
+   *pid = (int)(long)sa.arg1;
+}
+
+int GetProcStats(int pid, struct procStats *stats)
+{
+   sysargs sa;
+
+   CHECKMODE;
+   sa.number = SYS_GETPROCSTATS;
+   sa.arg1 = (void *)(long)pid;
+   sa.arg2 = stats;
+   usyscall(&sa);
+   return (int)(long)sa.arg4;
+}
+
+int Sleep(int seconds)
+{
+   sysargs sa;
+
+   CHECKMODE;
+   sa.number = SYS_SLEEP;
+   sa.arg1 = (void *)(long)seconds;
+   usyscall(&sa);
+   return (int)(long)sa.arg4;
+}
+
+int SleepUs(int micros)
+{
+   sysargs sa;
+
+   CHECKMODE;
+   sa.number = SYS_SLEEPUS;
+   sa.arg1 = (void *)(long)micros;
+   usyscall(&sa);
+   return (int)(long)sa.arg4;
+}
+
+/* *status is the device status, 0 if the read succeeded */
+int DiskRead(void *buffer, int unit, int track, int first, int sectors,
+             int *status)
+{
+   sysargs sa;
+
+   CHECKMODE;
+   sa.number = SYS_DISKREAD;
+   sa.arg1 = buffer;
+   sa.arg2 = (void *)(long)sectors;
+   sa.arg3 = (void *)(long)track;
+   sa.arg4 = (void *)(long)first;
+   sa.arg5 = (void *)(long)unit;
+   usyscall(&sa);
+   *status = (int)(long)sa.arg1;
+   return (int)(long)sa.arg4;
+}
+
+/* *status is the device status, 0 if the write succeeded */
+int DiskWrite(void *buffer, int unit, int track, int first, int sectors,
+              int *status)
+{
+   sysargs sa;
+
+   CHECKMODE;
+   sa.number = SYS_DISKWRITE;
+   sa.arg1 = buffer;
+   sa.arg2 = (void *)(long)sectors;
+   sa.arg3 = (void *)(long)track;
+   sa.arg4 = (void *)(long)first;
+   sa.arg5 = (void *)(long)unit;
+   usyscall(&sa);
+   *status = (int)(long)sa.arg1;
+   return (int)(long)sa.arg4;
+}
+
+int DiskSize(int unit, int *sector, int *track, int *disk)
+{
+   sysargs sa;
+
+   CHECKMODE;
+   sa.number = SYS_DISKSIZE;
+   sa.arg1 = (void *)(long)unit;
+   usyscall(&sa);
+   *sector = (int)(long)sa.arg1;
+   *track = (int)(long)sa.arg2;
+   *disk = (int)(long)sa.arg3;
+   return (int)(long)sa.arg4;
+}
+
+/* Returns 0, -1 for bad arguments, -2 if the completion mailbox has no
+ * slot free for the completion */
+int DiskReadAsync(struct DiskAsyncArgs *args, int *handle)
+{
+   sysargs sa;
+
+   CHECKMODE;
+   sa.number = SYS_DISKREADASYNC;
+   sa.arg1 = args;
+   usyscall(&sa);
+   *handle = (int)(long)sa.arg1;
+   return (int)(long)sa.arg4;
+}
+
+/* Returns 0, -1 for bad arguments, -2 if the completion mailbox has no
+ * slot free for the completion */
+int DiskWriteAsync(struct DiskAsyncArgs *args, int *handle)
+{
+   sysargs sa;
+
+   CHECKMODE;
+   sa.number = SYS_DISKWRITEASYNC;
+   sa.arg1 = args;
+   usyscall(&sa);
+   *handle = (int)(long)sa.arg1;
+   return (int)(long)sa.arg4;
+}
+
+int DiskCacheStats(struct diskCacheStats *stats)
+{
+   sysargs sa;
+
+   CHECKMODE;
+   sa.number = SYS_DISKCACHESTATS;
+   sa.arg1 = stats;
+   usyscall(&sa);
+   return (int)(long)sa.arg4;
+}
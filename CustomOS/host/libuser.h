@@ -0,0 +1,40 @@
+/* ------------------------------------------------------------------------
+   libuser.h
+
+   User mode wrappers for the system calls (host/libuser.c). Each fills
+   in a sysargs, raises the syscall interrupt and unpacks the results.
+   Unless noted otherwise they return 0, or -1 for bad arguments.
+   ------------------------------------------------------------------------ */
+#ifndef LIBUSER_H
+#define LIBUSER_H
+
+struct SpawnManyArgs;
+struct DiskAsyncArgs;
+struct diskCacheStats;
+struct procStats;
+
+extern int Spawn(char *name, int (*func)(char *), char *arg, int stack_size,
+                 int priority, int *pid);
+extern int SpawnMany(struct SpawnManyArgs *args, int *created);
+extern int Wait(int *pid, int *status);
+extern void Terminate(int status);
+extern int SemCreate(int value, int *semaphore);
+extern int SemP(int semaphore);
+extern int SemV(int semaphore);
+extern int SemFree(int semaphore);
+extern void GetTimeofDay(int *tod);
+extern void CPUTime(int *cpu);
+extern void GetPID(int *pid);
+extern int GetProcStats(int pid, struct procStats *stats);
+extern int Sleep(int seconds);
+extern int SleepUs(int micros);
+extern int DiskRead(void *buffer, int unit, int track, int first, int sectors,
+                    int *status);
+extern int DiskWrite(void *buffer, int unit, int track, int first, int sectors,
+                     int *status);
+extern int DiskSize(int unit, int *sector, int *track, int *disk);
+extern int DiskReadAsync(struct DiskAsyncArgs *args, int *handle);
+extern int DiskWriteAsync(struct DiskAsyncArgs *args, int *handle);
+extern int DiskCacheStats(struct diskCacheStats *stats);
+
+#endif
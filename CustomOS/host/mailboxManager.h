@@ -0,0 +1,26 @@
+/* ------------------------------------------------------------------------
+   mailboxManager.h
+
+   Limits and entry points of phase 2 (mailboxManager.c) used by the
+   phases above it.
+   ------------------------------------------------------------------------ */
+#ifndef MAILBOXMANAGER_H
+#define MAILBOXMANAGER_H
+
+#include <usyscall.h>
+
+#define MAXMBOX 2000
+#define MAXSLOTS 2500
+#define MAX_MESSAGE 150
+
+extern int MboxCreate(int slots, int slot_size);
+extern int MboxRelease(int mbox_id);
+extern int MboxSend(int mbox_id, void *msg_ptr, int msg_size);
+extern int MboxReceive(int mbox_id, void *msg_ptr, int msg_size);
+extern int MboxCondSend(int mbox_id, void *msg_ptr, int msg_size);
+extern int MboxCondReceive(int mbox_id, void *msg_ptr, int msg_size);
+extern int waitdevice(int type, int unit, int *status);
+
+extern void (*sys_vec[MAXSYSCALLS])(sysargs *args);
+
+#endif
@@ -0,0 +1,40 @@
+/* ------------------------------------------------------------------------
+   processManager.h
+
+   Limits and entry points of phase 1 (processManager.c) used by the
+   phases above it.
+   ------------------------------------------------------------------------ */
+#ifndef PROCESSMANAGER_H
+#define PROCESSMANAGER_H
+
+#include <usloss.h>
+
+#define MAXPROC 50
+#define MAXNAME 50
+#define MAXARG 100
+#define HIGHEST_PRIORITY 1
+#define LOWEST_PRIORITY 6 /* the sentinel's */
+
+extern int fork1(char *name, int (*func)(char *), char *arg,
+                 int stacksize, int priority);
+extern int join(int *status);
+extern void quit(int status);
+extern int zap(int pid);
+extern int is_zapped(void);
+extern int getpid(void);
+extern void dump_processes(void);
+extern int block_me(int block_status);
+extern int unblock_proc(int pid);
+extern int read_cur_start_time(void);
+extern void time_slice(void);
+extern int readtime(void);
+extern void hold_dispatch(void);
+extern void release_dispatch(void);
+extern void check_preempt(void);
+
+/* Supplied by phase 2 */
+extern void p1_fork(int pid);
+extern void p1_switch(int old, int new);
+extern void p1_quit(int pid);
+
+#endif
@@ -0,0 +1,61 @@
+/* ------------------------------------------------------------------------
+   start4.c
+
+   Sample first user process for the customos target. Runs a child that
+   hands a semaphore back and forth, sleeps, and writes then reads back
+   a few sectors of disk 0.
+   ------------------------------------------------------------------------ */
+#include <string.h>
+#include <usloss.h>
+#include <libuser.h>
+
+static int ping;
+static int pong;
+
+static int child(char *arg)
+{
+   for (int i = 0; i < 3; i++)
+   {
+      SemP(ping);
+      console("child: ping %d\n", i);
+      SemV(pong);
+   }
+   return 3;
+}
+
+int start4(char *arg)
+{
+   char out[4 * DISK_SECTOR_SIZE];
+   char in[4 * DISK_SECTOR_SIZE];
+   int pid;
+   int status;
+   int before;
+   int after;
+
+   SemCreate(0, &ping);
+   SemCreate(0, &pong);
+   Spawn("child", child, NULL, USLOSS_MIN_STACK, 2, &pid);
+   for (int i = 0; i < 3; i++)
+   {
+      SemV(ping);
+      SemP(pong);
+   }
+   Wait(&pid, &status);
+   console("start4: child %d quit with %d\n", pid, status);
+
+   GetTimeofDay(&before);
+   SleepUs(50000);
+   GetTimeofDay(&after);
+   console("start4: slept %d us\n", after - before);
+
+   for (int i = 0; i < (int)sizeof(out); i++)
+   {
+      out[i] = (char)i;
+   }
+   DiskWrite(out, 0, 1, 2, 4, &status);
+   DiskRead(in, 0, 1, 2, 4, &status);
+   console("start4: disk read back %s\n",
+           status == 0 && memcmp(in, out, sizeof(in)) == 0 ? "ok" : "WRONG");
+
+   return 0;
+}
@@ -0,0 +1,560 @@
+/* ------------------------------------------------------------------------
+   usloss.c
+
+   Host stand-in for the USLOSS simulator, enough to run and benchmark the
+   four kernel phases as one Linux process.
+
+   Contexts are ucontext_t's, each carrying its own PSR. The clock is a
+   CLOCK_TICK interval timer (SIGALRM), or in tickless mode a one-shot
+   timer set for the earliest time clock_program was given. Interrupts
+   are only taken at safe
+   points: when the timer fires while a process runs in user mode with
+   interrupts enabled, when a syscall returns to user mode, and in waitint.
+   The kernel itself is never interrupted, as if it always ran with
+   interrupts disabled. User code must not call into libc other than
+   through console, which this file guards.
+
+   Disk unit N is backed by the file diskN in the working directory,
+   created with DISK_DEFAULT_TRACKS tracks if it is missing. Every
+   operation is carried out at once, then the unit stays busy for a
+   simulated seek or transfer time before it raises DISK_INT.
+   ------------------------------------------------------------------------ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/prctl.h>
+#include <usloss.h>
+
+#define DISK_DEFAULT_TRACKS 64
+#define DISK_SECTOR_TIME 100 /* microseconds to transfer a sector */
+#define DISK_SETTLE_TIME 200 /* microseconds for any seek that moves the arm */
+#define DISK_TRACK_TIME 20   /* microseconds more per track crossed */
+#define DISK_CMD_TIME 10     /* microseconds for a DISK_TRACKS query */
+
+/* One simulated disk unit */
+typedef struct diskUnit
+{
+   int fd;
+   int tracks;
+   int armTrack;
+   int busy;            /* 1 until the current operation completes */
+   unsigned int doneAt; /* sys_clock() at which it completes */
+   int status;          /* DEV_READY or DEV_ERROR for device_input */
+} diskUnit;
+
+void (*int_vec[NUM_INTS])(int dev, void *unit);
+
+static volatile unsigned int psr = PSR_CURRENT_MODE;
+static volatile sig_atomic_t clockPending = 0;
+static volatile sig_atomic_t hostBusy = 0; /* > 0 inside console */
+static int tickless = 0;       /* 1 if the clock only interrupts when programmed */
+static volatile sig_atomic_t shotArmed = 0; /* 1 while a one-shot is set */
+static int shotAt;             /* sys_clock() the one-shot is set for */
+static int interrupts = 0;     /* clock and disk interrupts taken */
+static struct timespec bootTime;
+static diskUnit disks[DISK_UNITS];
+
+static void deliverInterrupts(void);
+static void openDisks(void);
+static void startClock(void);
+
+/* ------------------------------------------------------------------------
+   Name - main
+   Purpose - Opens the disks, starts the clock and boots the kernel.
+   Parameters - ignored
+   Returns - never, the kernel ends the run with halt
+   Side Effects - creates missing disk files
+   ----------------------------------------------------------------------- */
+int main(int argc, char *argv[])
+{
+   clock_gettime(CLOCK_MONOTONIC, &bootTime);
+   prctl(PR_SET_TIMERSLACK, 1); // waitint's sleeps end when the disk is done, not 50us later
+   openDisks();
+   startClock();
+
+   psr = PSR_CURRENT_MODE; // kernel mode, interrupts off
+   startup();
+
+   console("startup() returned\n");
+   halt(1);
+   return 1;
+}
+
+/* Ends the run, dump is the exit status */
+void halt(int dump)
+{
+   finish();
+   fflush(stdout);
+   exit(dump);
+}
+
+void console(char *fmt, ...)
+{
+   va_list args;
+
+   hostBusy++;
+   va_start(args, fmt);
+   vprintf(fmt, args);
+   va_end(args);
+   fflush(stdout);
+   hostBusy--;
+}
+
+/* Microseconds since the run started */
+int sys_clock(void)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (int)((now.tv_sec - bootTime.tv_sec) * 1000000 +
+                (now.tv_nsec - bootTime.tv_nsec) / 1000);
+}
+
+unsigned int psr_get(void)
+{
+   return psr;
+}
+
+/* Dropping to user mode with interrupts on takes anything pending */
+void psr_set(unsigned int value)
+{
+   psr = value & (PSR_CURRENT_MODE | PSR_CURRENT_INT | PSR_PREV_MODE | PSR_PREV_INT);
+
+   if ((psr & PSR_CURRENT_MODE) == 0 && (psr & PSR_CURRENT_INT))
+   {
+      deliverInterrupts();
+   }
+}
+
+/* ------------------------------------------------------------------------
+   Name - context_init
+   Purpose - Sets up a context that starts running func on the given stack.
+   Parameters - the context, the PSR it starts with, the stack and its size,
+                the function to run. func must never return.
+   Returns - nothing
+   Side Effects - none
+   ----------------------------------------------------------------------- */
+void context_init(context *state, unsigned int initPsr, char *stack,
+                  int stackSize, void (*func)(void))
+{
+   getcontext(&state->uc);
+   state->uc.uc_stack.ss_sp = stack;
+   state->uc.uc_stack.ss_size = stackSize;
+   state->uc.uc_link = NULL;
+   sigemptyset(&state->uc.uc_sigmask);
+   makecontext(&state->uc, func, 0);
+   state->psr = initPsr;
+}
+
+/*
+ * Saves the running context, with its PSR, in old and resumes new. old
+ * may be NULL when nothing needs saving. Switching to the running
+ * context does nothing.
+ */
+void context_switch(context *old, context *new)
+{
+   if (old == new)
+   {
+      return;
+   }
+
+   if (old == NULL)
+   {
+      psr = new->psr;
+      setcontext(&new->uc);
+      return;
+   }
+
+   old->psr = psr;
+   psr = new->psr;
+   swapcontext(&old->uc, &new->uc);
+}
+
+/* Calls the handler for an interrupt the way the hardware would: in
+ * kernel mode with interrupts off, the old mode and enable saved in the
+ * previous bits, all of which is undone when the handler returns. */
+static void raiseInterrupt(int intNum, int dev, int unit, void *arg)
+{
+   unsigned int saved = psr;
+
+   psr = PSR_CURRENT_MODE |
+         ((saved & PSR_CURRENT_MODE) ? PSR_PREV_MODE : 0) |
+         ((saved & PSR_CURRENT_INT) ? PSR_PREV_INT : 0);
+   if (intNum != SYSCALL_INT)
+   {
+      interrupts++;
+   }
+
+   if (int_vec[intNum] != NULL)
+   {
+      int_vec[intNum](dev, arg != NULL ? arg : (void *)(long)unit);
+   }
+
+   psr = saved;
+}
+
+/* Returns the unit of a disk whose operation is done, or -1 */
+static int diskDone(void)
+{
+   int now = sys_clock();
+
+   for (int unit = 0; unit < DISK_UNITS; unit++)
+   {
+      if (disks[unit].busy && (int)(now - disks[unit].doneAt) >= 0)
+      {
+         return unit;
+      }
+   }
+   return -1;
+}
+
+/* Takes every pending interrupt, clock first */
+static void deliverInterrupts(void)
+{
+   int unit;
+
+   while (1)
+   {
+      if (clockPending)
+      {
+         clockPending = 0;
+         raiseInterrupt(CLOCK_INT, CLOCK_DEV, 0, NULL);
+      }
+      else if ((unit = diskDone()) != -1)
+      {
+         disks[unit].busy = 0;
+         raiseInterrupt(DISK_INT, DISK_DEV, unit, NULL);
+      }
+      else
+      {
+         break;
+      }
+   }
+}
+
+/* SIGALRM, a clock tick. Taken at once only if user code was running. */
+static void clockSignal(int sig)
+{
+   clockPending = 1;
+   shotArmed = 0;
+
+   if (hostBusy == 0 && (psr & PSR_CURRENT_MODE) == 0 && (psr & PSR_CURRENT_INT))
+   {
+      deliverInterrupts();
+   }
+}
+
+static void startClock(void)
+{
+   struct sigaction action;
+   struct itimerval timer;
+
+   memset(&action, 0, sizeof(action));
+   action.sa_handler = clockSignal;
+   action.sa_flags = SA_RESTART;
+   sigemptyset(&action.sa_mask);
+   sigaction(SIGALRM, &action, NULL);
+
+   timer.it_interval.tv_sec = 0;
+   timer.it_interval.tv_usec = CLOCK_TICK;
+   timer.it_value = timer.it_interval;
+   setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+/* ------------------------------------------------------------------------
+   Name - clock_tickless
+   Purpose - Switches the clock between ticking every CLOCK_TICK and
+             tickless mode, where it only interrupts at the times given
+             to clock_program.
+   Parameters - 1 for tickless, 0 to tick
+   Returns - nothing
+   Side Effects - a one-shot set in tickless mode is cancelled
+   ----------------------------------------------------------------------- */
+void clock_tickless(int on)
+{
+   struct itimerval timer;
+
+   memset(&timer, 0, sizeof(timer));
+   if (!on)
+   {
+      timer.it_interval.tv_usec = CLOCK_TICK;
+      timer.it_value = timer.it_interval;
+   }
+   tickless = on;
+   shotArmed = 0;
+   setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+/* ------------------------------------------------------------------------
+   Name - clock_program
+   Purpose - In tickless mode, asks for a clock interrupt at sys_clock()
+             time when. The one-shot is only moved if when is earlier
+             than the time it is set for, so every caller gets an
+             interrupt no later than it asked; one that comes early
+             should program its time again. Does nothing while ticking.
+   Parameters - the time, a past one interrupts at the next safe point
+   Returns - nothing
+   Side Effects - sets the interval timer
+   ----------------------------------------------------------------------- */
+void clock_program(int when)
+{
+   sigset_t alarm;
+   struct itimerval timer;
+   int wait = when - sys_clock();
+
+   if (!tickless)
+   {
+      return;
+   }
+
+   sigemptyset(&alarm);
+   sigaddset(&alarm, SIGALRM);
+   sigprocmask(SIG_BLOCK, &alarm, NULL);
+
+   if (!clockPending && !(shotArmed && (int)(shotAt - when) <= 0))
+   {
+      memset(&timer, 0, sizeof(timer));
+      if (wait <= 0)
+      {
+         clockPending = 1;
+         shotArmed = 0;
+      }
+      else
+      {
+         timer.it_value.tv_sec = wait / 1000000;
+         timer.it_value.tv_usec = wait % 1000000;
+         shotArmed = 1;
+         shotAt = when;
+      }
+      setitimer(ITIMER_REAL, &timer, NULL);
+   }
+
+   sigprocmask(SIG_UNBLOCK, &alarm, NULL);
+}
+
+/* Clock and disk interrupts taken since the run started */
+int interrupt_count(void)
+{
+   return interrupts;
+}
+
+/* ------------------------------------------------------------------------
+   Name - waitint
+   Purpose - Idles the machine until an interrupt comes in, then takes it.
+   Parameters - none
+   Returns - nothing
+   Side Effects - the interrupt handlers run
+   ----------------------------------------------------------------------- */
+void waitint(void)
+{
+   sigset_t alarm;
+   sigset_t unblocked;
+
+   sigemptyset(&alarm);
+   sigaddset(&alarm, SIGALRM);
+   sigprocmask(SIG_BLOCK, &alarm, &unblocked);
+   sigdelset(&unblocked, SIGALRM);
+
+   while (!clockPending && diskDone() == -1)
+   {
+      struct timespec timeout;
+      int wait = -1;
+
+      // sleep until the next disk completion, or the tick if none
+      for (int unit = 0; unit < DISK_UNITS; unit++)
+      {
+         if (disks[unit].busy)
+         {
+            int left = (int)(disks[unit].doneAt - sys_clock());
+            if (wait == -1 || left < wait)
+            {
+               wait = left > 0 ? left : 0;
+            }
+         }
+      }
+
+      timeout.tv_sec = wait / 1000000;
+      timeout.tv_nsec = (wait % 1000000) * 1000;
+      ppoll(NULL, 0, wait == -1 ? NULL : &timeout, &unblocked);
+   }
+
+   sigprocmask(SIG_UNBLOCK, &alarm, NULL);
+   deliverInterrupts();
+}
+
+/* ------------------------------------------------------------------------
+   Name - usyscall
+   Purpose - Raises the syscall interrupt with a sysargs block.
+   Parameters - the sysargs
+   Returns - nothing, results are in the sysargs
+   Side Effects - whatever the syscall does. Interrupts that came in
+                  during it are taken on the way back to user mode.
+   ----------------------------------------------------------------------- */
+void usyscall(void *args)
+{
+   raiseInterrupt(SYSCALL_INT, SYSCALL_INT, 0, args);
+
+   if ((psr & PSR_CURRENT_MODE) == 0 && (psr & PSR_CURRENT_INT))
+   {
+      deliverInterrupts();
+   }
+}
+
+/* Opens or creates the file behind each disk unit */
+static void openDisks(void)
+{
+   char name[16];
+   int trackBytes = DISK_TRACK_SIZE * DISK_SECTOR_SIZE;
+
+   for (int unit = 0; unit < DISK_UNITS; unit++)
+   {
+      sprintf(name, "disk%d", unit);
+      disks[unit].fd = open(name, O_RDWR | O_CREAT, 0644);
+      if (disks[unit].fd == -1)
+      {
+         perror(name);
+         exit(1);
+      }
+
+      off_t size = lseek(disks[unit].fd, 0, SEEK_END);
+      if (size < trackBytes)
+      {
+         size = (off_t)DISK_DEFAULT_TRACKS * trackBytes;
+         if (ftruncate(disks[unit].fd, size) == -1)
+         {
+            perror(name);
+            exit(1);
+         }
+      }
+      disks[unit].tracks = size / trackBytes;
+   }
+}
+
+/* ------------------------------------------------------------------------
+   Name - device_output
+   Purpose - Starts an operation on a device unit. Only disks take any.
+   Parameters - device type, unit, a device_request
+   Returns - DEV_OK, DEV_BUSY if the unit is still working, DEV_INVALID
+             for a bad device, unit or operation
+   Side Effects - the unit raises DISK_INT when the operation is done
+   ----------------------------------------------------------------------- */
+int device_output(int dev, int unit, void *arg)
+{
+   device_request *req = arg;
+   diskUnit *disk;
+   int latency = DISK_CMD_TIME;
+
+   if (dev != DISK_DEV || unit < 0 || unit >= DISK_UNITS || req == NULL)
+   {
+      return DEV_INVALID;
+   }
+
+   disk = &disks[unit];
+   if (disk->busy)
+   {
+      return DEV_BUSY;
+   }
+
+   disk->status = DEV_READY;
+   switch (req->opr)
+   {
+   case DISK_TRACKS:
+      *(int *)req->reg1 = disk->tracks;
+      break;
+
+   case DISK_SEEK:
+   {
+      int track = (int)(long)req->reg1;
+
+      if (track < 0 || track >= disk->tracks)
+      {
+         disk->status = DEV_ERROR;
+         break;
+      }
+      if (track != disk->armTrack)
+      {
+         int distance = track > disk->armTrack ? track - disk->armTrack : disk->armTrack - track;
+         latency = DISK_SETTLE_TIME + distance * DISK_TRACK_TIME;
+      }
+      disk->armTrack = track;
+      break;
+   }
+
+   case DISK_READ:
+   case DISK_WRITE:
+   case DISK_READ_RUN:
+   case DISK_WRITE_RUN:
+   {
+      int sector = (int)(long)req->reg1;
+      int count = req->opr == DISK_READ_RUN || req->opr == DISK_WRITE_RUN ? (int)(long)req->reg3 : 1;
+      off_t offset = ((off_t)disk->armTrack * DISK_TRACK_SIZE + sector) * DISK_SECTOR_SIZE;
+      ssize_t done;
+
+      // one command, one interrupt, but the head still passes each sector
+      if (sector < 0 || count < 1 || sector + count > DISK_TRACK_SIZE)
+      {
+         disk->status = DEV_ERROR;
+         break;
+      }
+      if (req->opr == DISK_READ || req->opr == DISK_READ_RUN)
+         done = pread(disk->fd, req->reg2, count * DISK_SECTOR_SIZE, offset);
+      else
+         done = pwrite(disk->fd, req->reg2, count * DISK_SECTOR_SIZE, offset);
+      if (done != count * DISK_SECTOR_SIZE)
+      {
+         disk->status = DEV_ERROR;
+      }
+      latency = count * DISK_SECTOR_TIME;
+      break;
+   }
+
+   default:
+      return DEV_INVALID;
+   }
+
+   disk->doneAt = sys_clock() + latency;
+   disk->busy = 1;
+   return DEV_OK;
+}
+
+/* ------------------------------------------------------------------------
+   Name - device_input
+   Purpose - Reads the status register of a device unit.
+   Parameters - device type, unit, where to put the status
+   Returns - DEV_OK, or DEV_INVALID for a bad device or unit
+   Side Effects - none
+   ----------------------------------------------------------------------- */
+int device_input(int dev, int unit, int *status)
+{
+   switch (dev)
+   {
+   case CLOCK_DEV:
+      if (unit != 0)
+         return DEV_INVALID;
+      *status = sys_clock();
+      return DEV_OK;
+
+   case DISK_DEV:
+      if (unit < 0 || unit >= DISK_UNITS)
+         return DEV_INVALID;
+      *status = disks[unit].busy ? DEV_BUSY : disks[unit].status;
+      return DEV_OK;
+
+   case TERM_DEV:
+      if (unit < 0 || unit >= TERM_UNITS)
+         return DEV_INVALID;
+      *status = DEV_READY;
+      return DEV_OK;
+
+   default:
+      return DEV_INVALID;
+   }
+}
@@ -0,0 +1,104 @@
+/* ------------------------------------------------------------------------
+   usloss.h
+
+   Host stand-in for the USLOSS simulator (host/usloss.c). Provides the
+   machine the kernel phases are written against: a simulated PSR,
+   contexts switched with ucontext, the interrupt vector, a clock that
+   interrupts every CLOCK_TICK microseconds, or only when asked to in
+   tickless mode, and file-backed disk units.
+   ------------------------------------------------------------------------ */
+#ifndef USLOSS_H
+#define USLOSS_H
+
+#include <ucontext.h>
+
+/* PSR bits */
+#define PSR_CURRENT_MODE 0x1 /* 1 for kernel mode */
+#define PSR_CURRENT_INT 0x2  /* 1 if interrupts are enabled */
+#define PSR_PREV_MODE 0x4    /* mode before the last interrupt */
+#define PSR_PREV_INT 0x8     /* interrupt enable before the last interrupt */
+
+/* Device types */
+#define CLOCK_DEV 0
+#define ALARM_DEV 1
+#define DISK_DEV 2
+#define TERM_DEV 3
+
+#define CLOCK_UNITS 1
+#define DISK_UNITS 2
+#define TERM_UNITS 4
+
+/* Interrupts, the indices of int_vec */
+#define CLOCK_INT 0
+#define ALARM_INT 1
+#define DISK_INT 2
+#define TERM_INT 3
+#define MMU_INT 4
+#define SYSCALL_INT 5
+#define NUM_INTS 6
+
+#define CLOCK_TICK 20000 /* microseconds between clock interrupts */
+
+/* Disk geometry */
+#define DISK_SECTOR_SIZE 512
+#define DISK_TRACK_SIZE 16 /* sectors per track */
+
+/* Disk operations, the opr of a device_request */
+#define DISK_READ 0  /* reg1 sector on the current track, reg2 buffer */
+#define DISK_WRITE 1 /* reg1 sector on the current track, reg2 buffer */
+#define DISK_SEEK 2  /* reg1 track */
+#define DISK_TRACKS 3 /* reg1 an int the track count is stored in */
+#define DISK_READ_RUN 4  /* reg1 first sector, reg2 buffer, reg3 sector count */
+#define DISK_WRITE_RUN 5 /* the run must end on the current track */
+
+/* device_output results */
+#define DEV_OK 0
+#define DEV_BUSY 1
+#define DEV_INVALID 2
+
+/* device_input statuses */
+#define DEV_READY 0
+#define DEV_ERROR 2
+
+#define USLOSS_MIN_STACK (80 * 1024)
+
+typedef struct device_request
+{
+   int opr;
+   void *reg1;
+   void *reg2;
+   void *reg3; /* only the run operations use it */
+} device_request;
+
+/* A process context, the PSR is part of it */
+typedef struct context
+{
+   ucontext_t uc;
+   unsigned int psr;
+} context;
+
+extern void (*int_vec[NUM_INTS])(int dev, void *unit);
+
+/* Supplied by the kernel */
+extern void startup(void);
+extern void finish(void);
+
+extern void context_init(context *state, unsigned int psr, char *stack,
+                         int stackSize, void (*func)(void));
+extern void context_switch(context *old, context *new);
+extern unsigned int psr_get(void);
+extern void psr_set(unsigned int psr);
+extern int sys_clock(void);
+extern void waitint(void);
+extern void halt(int dump);
+extern void console(char *fmt, ...);
+extern int device_output(int dev, int unit, void *arg);
+extern int device_input(int dev, int unit, int *status);
+extern void usyscall(void *args);
+
+/* Host only: the tickless clock and an interrupt count */
+extern void clock_tickless(int on);
+extern void clock_program(int when);
+extern int interrupt_count(void);
+
+#endif
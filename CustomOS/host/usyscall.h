@@ -0,0 +1,45 @@
+/* ------------------------------------------------------------------------
+   usyscall.h
+
+   System call numbers and the argument block passed with the syscall
+   interrupt. Phases 3 and 4 add their own numbers in sems.h and driver.h.
+   ------------------------------------------------------------------------ */
+#ifndef USYSCALL_H
+#define USYSCALL_H
+
+#define MAXSYSCALLS 50
+
+#define SYS_TERMREAD 1
+#define SYS_TERMWRITE 2
+#define SYS_SPAWN 3
+#define SYS_WAIT 4
+#define SYS_TERMINATE 5
+#define SYS_MBOXCREATE 6
+#define SYS_MBOXRELEASE 7
+#define SYS_MBOXSEND 8
+#define SYS_MBOXRECEIVE 9
+#define SYS_MBOXCONDSEND 10
+#define SYS_MBOXCONDRECEIVE 11
+#define SYS_SLEEP 12
+#define SYS_DISKREAD 13
+#define SYS_DISKWRITE 14
+#define SYS_DISKSIZE 15
+#define SYS_SEMCREATE 16
+#define SYS_SEMP 17
+#define SYS_SEMV 18
+#define SYS_SEMFREE 19
+#define SYS_GETTIMEOFDAY 20
+#define SYS_CPUTIME 21
+#define SYS_GETPID 22
+
+typedef struct sysargs
+{
+   int number;
+   void *arg1;
+   void *arg2;
+   void *arg3;
+   void *arg4;
+   void *arg5;
+} sysargs;
+
+#endif
@@ -1,4 +1,5 @@
 #define DEBUG 0
+#define STACK_GUARD 0 /* 1 to put a PROT_NONE guard page below every stack */
 
 typedef struct proc_struct proc_struct;
 
@@ -16,28 +17,55 @@ struct proc_struct
    proc_ptr next_proc_ptr;
    proc_ptr child_proc_ptr;
    proc_ptr next_sibling_ptr;
+   proc_ptr prev_sibling_ptr;
+
+   // children that have quit and are waiting to be joined, oldest first
+   proc_ptr quit_head;
+   proc_ptr quit_tail;
+   proc_ptr next_quit; // next in the parent's quit queue
 
    // points to next proc in list whether it is the ready list or blocked list
    proc_ptr next_in_list;
+   proc_ptr prev_in_list;
+   procLinkedList *cur_list; // the list this proc is currently on, NULL if none
 
    char name[MAXNAME];     /* process's name */
    char start_arg[MAXARG]; /* args passed to process */
    context state;          /* current context for process */
    int pid;                /* process id */
    int priority;
+   int base_priority; /* priority given at fork1, MLFQ never boosts above it */
    int (*start_func)(char *); /* function where process begins -- launch */
    void *stack;
    unsigned int stacksize;
-   int status; /* READY = 1 JOIN BLOCKED = 2 ZAPPED = 3 QUIT = 4 BLOCKED = 11 AND UP */
+   int status; /* READY = 1 QUIT = 4 JOIN BLOCKED = 9 ZAP BLOCKED = 10 BLOCKED = 11 AND UP */
    /* other fields as needed... */
    int parent_pid;
    int num_children;
    int cur_start_time;
-   long total_cpu_time;
+   unsigned int state_since; /* sys_clock() when it last became ready or blocked */
+   int disk_wait;            /* 1 while blocked on a disk request */
+   procStats stats;
    int status_to_parent;
    int slot; // the slot in the ProcTable
+
+   int zapped;           /* 1 once some proc has zapped this one */
+   proc_ptr zapper_head; /* procs blocked in zap until this one quits */
+   proc_ptr next_zapper; /* next in the zapper list of the proc we zapped */
 };
 
+/* Stack size classes are 1, 2, 4 and 8 times USLOSS_MIN_STACK */
+#define NUM_STACK_CLASSES 4
+#define STACKS_PER_CLASS 4 /* stacks of each class made at startup */
+
+/* Free stacks of one size class, reused across fork1 and join */
+typedef struct stackPool
+{
+   int stackSize;
+   int numFree;
+   void *freeStacks[MAXPROC];
+} stackPool;
+
 struct psr_bits
 {
    unsigned int cur_mode : 1;
@@ -58,3 +86,8 @@ union psr_values
 #define MAXPRIORITY 1
 #define SENTINELPID 1
 #define SENTINELPRIORITY LOWEST_PRIORITY
+
+/* Scheduling policies */
+#define SCHED_FIXED 0 /* fixed priority round robin */
+#define SCHED_MLFQ 1  /* multilevel feedback queue */
+#define FIXED_QUANTUM 80000 /* 80,000 microseconds = 80ms */
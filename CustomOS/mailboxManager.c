@@ -12,10 +12,22 @@
 #include <stdio.h>
 
 #include "message.h"
+#include "trace.h"
+#include "stats.h"
 
 /* ------------------------- Prototypes ----------------------------------- */
 int start1(char *);
 extern int start2(char *);
+int MboxSendRef(int, void *, int);
+int MboxReceiveRef(int, void **);
+int MboxSelect(int *, int, int);
+int MboxSendMany(int, void **, int *, int);
+int MboxReceiveMany(int, void **, int *, int);
+int MboxExists(int);
+int MboxReserve(int);
+int MboxSendReserved(int, int, void *, int);
+void get_slot_stats(int *, int *, int *, int *);
+void dump_mbox_stats(void);
 void check_kernel_mode(void);
 void enableInterrupts(void);
 void disableInterrupts(void);
@@ -23,13 +35,34 @@ static void nullsys(sysargs *args);
 int assignMailBoxID(void);
 int getSlot(int);
 void freeSlots(int);
-int nextOpenMailSlot(void);
+int allocMailSlot(void);
+void releaseMailSlot(int);
+void initPayloadPools(void);
+int allocPayload(int, char **);
+void freePayload(int, char *);
 void removeMSG(int);
+void appendMSG(int, int);
 void addToWaitingList(int);
-void addToBlockedList(int);
-void handleProc();
-void zapWaiting(int);
+static void addToBlockedList(int);
+int popWaiting(int);
+int popBlocked(int);
+static int sendMSG(int, void *, int, int);
+static int receiveMSG(int, void *, int, int);
+int handOff(int, void *, int, int);
+int fillSlot(int, int, void *, int, int);
+void p1_fork(int);
+void p1_switch(int, int);
+void p1_quit(int);
+void releaseWaiting(int);
 void unblockBlocked(int);
+static void leaveBox(int);
+static void postDeviceStatus(int, int);
+void notifySelectors(int, int);
+void expireSelectors(void);
+static int selectable(int);
+static void notifySenderBlocked(int);
+static void addTimedSelector(mbox_proc_ptr);
+static void removeTimedSelector(mbox_proc_ptr);
 
 void clock_handler(int, void *);
 void alarm_handler(int, void *);
@@ -44,6 +77,7 @@ int debugflag2 = 0;
 
 int nextMailBoxID = 1;
 
+/* The MBoxProcTable entry of the running process, kept by p1_switch */
 mbox_proc_ptr CurrentProc;
 
 /* The current number of Mailboxes*/
@@ -52,6 +86,19 @@ int numMailBoxes;
 /* The number of slots in use*/
 int mail_slots_used = 0;
 
+/* The most slots that have been in use at once */
+int mail_slots_high_water = 0;
+
+/* The number of sends that failed because no slot or payload was left */
+int mail_slot_alloc_failures = 0;
+
+/* The number of payloads that overflowed their pools onto the heap */
+int payload_heap_allocs = 0;
+
+/* Stack of free indices into the MailSlotTable */
+int freeSlotStack[MAXSLOTS];
+int freeSlotTop = 0;
+
 /* The syscall vector*/
 void (*sys_vec[MAXSYSCALLS])(sysargs *args);
 
@@ -61,9 +108,40 @@ mail_box MailBoxTable[MAXMBOX];
 /* shared table for all mailboxes with slots*/
 mail_slot MailSlotTable[MAXSLOTS];
 
-/* Special Proc Table */
+/* Payload storage for each size class. Smaller classes get more buffers
+ * since most messages are small; a message that doesn't fit its class
+ * falls back to the next larger one, and past the largest to the heap,
+ * so any MAXSLOTS messages can be queued. */
+static char smallPayloads[MAXSLOTS][SMALL_MSG_SIZE];
+static char mediumPayloads[MAXSLOTS / 2][MEDIUM_MSG_SIZE];
+static char largePayloads[MAXSLOTS / 4][MAX_MESSAGE];
+static int smallFree[MAXSLOTS];
+static int mediumFree[MAXSLOTS / 2];
+static int largeFree[MAXSLOTS / 4];
+
+payloadPool PayloadPools[NUM_SIZE_CLASSES];
+
+/* Special Proc Table, indexed by pid % MAXPROC like the ProcTable */
 mbox_proc MBoxProcTable[MAXPROC];
 
+/* The selector list nodes of each proc, one per mailbox it selects on */
+selectNode SelectNodeTable[MAXPROC][MAX_SELECT];
+
+/* Procs in an MboxSelect with a timeout, the soonest to expire first */
+mbox_proc_ptr timedSelectors = NULL;
+mbox_proc_ptr lastTimedSelector = NULL;
+
+/* Phase 1's clock handler, which does the time slicing */
+static void (*phase1ClockHandler)(int, void *);
+
+/* Mailboxes the interrupt handlers post device status on, see waitdevice */
+static int clockBox;
+static int diskBoxes[DISK_UNITS];
+static int termBoxes[TERM_UNITS];
+
+/* Set while an interrupt handler posts a device status */
+static int postingDeviceStatus = 0;
+
 /* -----------------------------------------------------------------------
    Name - start1
    Purpose - Initializes mailboxes and interrupt vector.
@@ -88,14 +166,34 @@ int start1(char *arg)
     * handlers */
    memset(MailBoxTable, 0, MAXMBOX * sizeof(MailBoxTable[0]));
    memset(MailSlotTable, 0, MAXSLOTS * sizeof(MailSlotTable[0]));
-   memset(MBoxProcTable, 0, MAXPROC * sizeof(MBoxProcTable[0]));
+   /* MBoxProcTable is not cleared here, p1_fork has already registered
+    * the sentinel and this process */
 
-   // create the 6 mailboxes for the interrupt vector
-   for (int i = 0; i < 6; i++)
+   // every slot starts out free, lowest index on top of the stack
+   for (int i = 0; i < MAXSLOTS; i++)
+   {
+      freeSlotStack[i] = MAXSLOTS - 1 - i;
+   }
+   freeSlotTop = MAXSLOTS;
+   mail_slots_used = 0;
+   mail_slots_high_water = 0;
+   mail_slot_alloc_failures = 0;
+   payload_heap_allocs = 0;
+   initPayloadPools();
+
+   /* one mailbox per device unit for waitdevice, with a slot so a status
+    * that comes in before the driver waits for it isn't lost */
+   clockBox = MboxCreate(1, sizeof(int));
+   for (int i = 0; i < DISK_UNITS; i++)
+   {
+      diskBoxes[i] = MboxCreate(1, sizeof(int));
+   }
+   for (int i = 0; i < TERM_UNITS; i++)
    {
-      MboxCreate(0, 1);
+      termBoxes[i] = MboxCreate(1, sizeof(int));
    }
 
+   phase1ClockHandler = int_vec[CLOCK_INT]; // chained to by clock_handler
    int_vec[CLOCK_INT] = clock_handler;
    int_vec[ALARM_INT] = alarm_handler;
    int_vec[DISK_INT] = disk_handler;
@@ -119,6 +217,11 @@ int start1(char *arg)
       console("start2(): join returned something other than start2's pid\n");
    }
 
+   if (DEBUG2 && debugflag2)
+   {
+      dump_mbox_stats();
+   }
+
    return 0;
 } /* start1 */
 
@@ -134,7 +237,6 @@ int start1(char *arg)
 int MboxCreate(int slots, int slot_size)
 {
    check_kernel_mode();
-   handleProc();
    if (numMailBoxes >= MAXMBOX || slot_size < 0 || slot_size > MAX_MESSAGE || slots < 0)
    {
       return -1;
@@ -161,12 +263,12 @@ int MboxCreate(int slots, int slot_size)
    Returns - -3 if the process was zapped while releasing the mailbox.
              -1 if the mailboxID is not a mailbox that is in use
               0 if the mailbox was released successfully
-   Side Effects - Zaps processes waiting on the mailbox. Unblocks waiting procs.
+   Side Effects - Wakes procs waiting to receive from or send to the
+                  mailbox, their calls return -3.
    ----------------------------------------------------------------------- */
 int MboxRelease(int mailboxID)
 {
    check_kernel_mode();
-   handleProc();
    int mBoxTableSlot = getSlot(mailboxID);
 
    if (mBoxTableSlot == -1)
@@ -182,8 +284,9 @@ int MboxRelease(int mailboxID)
 
    MailBoxTable[mBoxTableSlot].isReleased = 1; // mark it as released
 
-   zapWaiting(mBoxTableSlot);
+   releaseWaiting(mBoxTableSlot);
    unblockBlocked(mBoxTableSlot);
+   notifySelectors(mBoxTableSlot, -3);
    freeSlots(mBoxTableSlot);
 
    memset(&MailBoxTable[mBoxTableSlot], 0, sizeof(MailBoxTable[0])); // Free the mailbox slot in table
@@ -195,24 +298,87 @@ int MboxRelease(int mailboxID)
 
 } /* MboxRelease*/
 
+/* ------------------------------------------------------------------------
+   Name - MboxExists
+   Purpose - Checks that a mailbox id can be sent to, for callers that
+             hold on to an id and send to it later.
+   Parameters - mailbox id
+   Returns - 1 if the mailbox is in use and not released, 0 otherwise.
+   Side Effects - none.
+   ----------------------------------------------------------------------- */
+int MboxExists(int mbox_id)
+{
+   int mBoxTableSlot = getSlot(mbox_id);
+
+   return mBoxTableSlot != -1 && !MailBoxTable[mBoxTableSlot].isReleased;
+} /* MboxExists */
+
 /* ------------------------------------------------------------------------
    Name - MboxSend
    Purpose - Put a message into a slot for the indicated mailbox.
-             Block the sending process if no slot available.
+             Block the sending process if no slot available. If a receiver
+             is already waiting the message is copied straight into its
+             buffer and no slot is used.
    Parameters - mailbox id, pointer to data of msg, # of bytes in msg.
-   Returns - zero if successful, -1 if invalid args.
+   Returns - zero if successful, -1 if invalid args, -2 if the system is
+             out of mail slots, -3 if zapped or the mailbox was released.
    Side Effects - none.
    ----------------------------------------------------------------------- */
 int MboxSend(int mbox_id, void *msg_ptr, int msg_size)
+{
+   return sendMSG(mbox_id, msg_ptr, msg_size, 0);
+} /* MboxSend */
+
+/* ------------------------------------------------------------------------
+   Name - MboxSendRef
+   Purpose - Like MboxSend, but passes ownership of the caller's buffer
+             instead of copying it. The buffer must stay valid until the
+             receiver is done with it.
+   Parameters - mailbox id, the buffer to hand over, # of bytes in msg.
+   Returns - same as MboxSend.
+   Side Effects - none.
+   ----------------------------------------------------------------------- */
+int MboxSendRef(int mbox_id, void *buf, int msg_size)
+{
+   return sendMSG(mbox_id, buf, msg_size, 1);
+} /* MboxSendRef */
+
+/* ------------------------------------------------------------------------
+   Name - MboxReceive
+   Purpose - Get a msg from a slot of the indicated mailbox.
+             Block the receiving process if no msg available.
+   Parameters - mailbox id, pointer to put data of msg, max # of bytes that
+                can be received.
+   Returns - actual size of msg if successful, -1 if invalid args.
+   Side Effects - none.
+   ----------------------------------------------------------------------- */
+int MboxReceive(int mbox_id, void *msg_ptr, int msg_size)
+{
+   return receiveMSG(mbox_id, msg_ptr, msg_size, 0);
+} /* MboxReceive */
+
+/* ------------------------------------------------------------------------
+   Name - MboxReceiveRef
+   Purpose - Takes ownership of a buffer sent with MboxSendRef without
+             copying it. Blocks if no msg is available.
+   Parameters - mailbox id, where to store the pointer to the buffer.
+   Returns - size of msg if successful, -1 if invalid args or the next
+             msg was not sent by reference, -3 if zapped or released.
+   Side Effects - none.
+   ----------------------------------------------------------------------- */
+int MboxReceiveRef(int mbox_id, void **buf_ptr)
+{
+   return receiveMSG(mbox_id, buf_ptr, MAX_MESSAGE, 1);
+} /* MboxReceiveRef */
+
+/*
+ * Does the work of MboxSend and MboxSendRef. isRef says whether msg_ptr
+ * is handed over by reference or copied.
+ */
+static int sendMSG(int mbox_id, void *msg_ptr, int msg_size, int isRef)
 {
    check_kernel_mode();
-   handleProc();
 
-   if (mail_slots_used >= MAXSLOTS)
-   {
-      console("ERROR: THE SYSTEM IS OUT OF MAILBOX SLOTS \n");
-      halt(1);
-   }
    int mboxTableSlot = getSlot(mbox_id);
 
    if (mboxTableSlot == -1)
@@ -225,78 +391,82 @@ int MboxSend(int mbox_id, void *msg_ptr, int msg_size)
       return -1;
    }
 
-   /*Block the process if theres no space to queue and no procs waiting */
-   if (MailBoxTable[mboxTableSlot].numWaiting == 0 && MailBoxTable[mboxTableSlot].unused_slots == 0)
+   while (1)
    {
+      if (is_zapped() || MailBoxTable[mboxTableSlot].isReleased)
+      {
+         return -3;
+      }
+
+      disableInterrupts();
+
+      // Rendezvous with a waiting receiver, no slot needed
+      if (handOff(mboxTableSlot, msg_ptr, msg_size, isRef))
+      {
+         enableInterrupts();
+         TRACE(TRACE_MBOX_SEND, mbox_id, msg_size);
+         add_msg_stats(1, msg_size);
+         return 0;
+      }
+
+      if (MailBoxTable[mboxTableSlot].unused_slots > 0)
+      {
+         break; // queue it, interrupts stay off
+      }
+      enableInterrupts();
+
+      /*Block the process if theres no space to queue and nobody took it.
+       * A receiver or a freed slot wakes us to try again. */
       addToBlockedList(mboxTableSlot);
-      block_me(11);
-   }
+      notifySenderBlocked(mboxTableSlot);
+      TRACE(TRACE_MBOX_BLOCK, mbox_id, 0);
+      block_me(MBOX_BLOCKED);
 
-   if (is_zapped() || MailBoxTable[mboxTableSlot].isReleased)
-   {
-      return -3;
+      leaveBox(mboxTableSlot);
+      if (CurrentProc->released)
+      {
+         CurrentProc->released = 0;
+         return -3;
+      }
    }
 
-   disableInterrupts();
-   int slotTableIndex = nextOpenMailSlot();
-
-   MailSlotTable[slotTableIndex].isOccupied = 1;
-   MailSlotTable[slotTableIndex].index = slotTableIndex;
-   MailSlotTable[slotTableIndex].mbox_id = MailBoxTable[mboxTableSlot].mbox_id;
-   MailSlotTable[slotTableIndex].messageSize = msg_size;
-   MailSlotTable[slotTableIndex].next_in_box = NULL;                 // make sure thee's nothing in the next field yet
-   memcpy(MailSlotTable[slotTableIndex].message, msg_ptr, msg_size); // Put the message in the slot
+   int slotTableIndex = allocMailSlot();
 
-   // Put the mailslot in the appropriate place in the mailbox
-   if (MailBoxTable[mboxTableSlot].first_slot == NULL)
+   if (slotTableIndex == -1)
    {
-      MailBoxTable[mboxTableSlot].first_slot = &MailSlotTable[slotTableIndex];
+      enableInterrupts();
+      return -2;
    }
-   else
-   {
-      slot_ptr curSlot = MailBoxTable[mboxTableSlot].first_slot;
 
-      // find the end of the linked list
-      while (curSlot->next_in_box != NULL)
-      {
-         curSlot = curSlot->next_in_box;
-      }
-      // add to the end of the linked list
-      curSlot->next_in_box = &MailSlotTable[slotTableIndex];
+   if (fillSlot(mboxTableSlot, slotTableIndex, msg_ptr, msg_size, isRef) == -1)
+   {
+      releaseMailSlot(slotTableIndex);
+      enableInterrupts();
+      return -2;
    }
 
-   MailBoxTable[mboxTableSlot].unused_slots--;
+   // Put the mailslot at the end of the mailbox
+   appendMSG(mboxTableSlot, slotTableIndex);
 
    // Wake up the next waiting process
    if (MailBoxTable[mboxTableSlot].numWaiting > 0)
    {
-      int waiting_pid = MailBoxTable[mboxTableSlot].waitingProc->pid;
-      mbox_proc_ptr old = MailBoxTable[mboxTableSlot].waitingProc;
-
-      // Advance the queue
-      MailBoxTable[mboxTableSlot].waitingProc = MailBoxTable[mboxTableSlot].waitingProc->next;
-      MailBoxTable[mboxTableSlot].numWaiting--;
-      old->next = NULL;
-      unblock_proc(waiting_pid);
+      unblock_proc(popWaiting(mboxTableSlot));
    }
    enableInterrupts();
+   TRACE(TRACE_MBOX_SEND, mbox_id, msg_size);
+   add_msg_stats(1, msg_size);
 
    return 0;
-} /* MboxSend */
+} /* sendMSG */
 
-/* ------------------------------------------------------------------------
-   Name - MboxReceive
-   Purpose - Get a msg from a slot of the indicated mailbox.
-             Block the receiving process if no msg available.
-   Parameters - mailbox id, pointer to put data of msg, max # of bytes that
-                can be received.
-   Returns - actual size of msg if successful, -1 if invalid args.
-   Side Effects - none.
-   ----------------------------------------------------------------------- */
-int MboxReceive(int mbox_id, void *msg_ptr, int msg_size)
+/*
+ * Does the work of MboxReceive and MboxReceiveRef. If wantsRef is set,
+ * msg_ptr is a void ** that receives the sender's buffer.
+ */
+static int receiveMSG(int mbox_id, void *msg_ptr, int msg_size, int wantsRef)
 {
    check_kernel_mode();
-   handleProc();
 
    int mboxTableSlot = getSlot(mbox_id);
 
@@ -307,43 +477,87 @@ int MboxReceive(int mbox_id, void *msg_ptr, int msg_size)
 
    if (MailBoxTable[mboxTableSlot].first_slot == NULL)
    {
+      // a zapped proc must not wait for a message that may never come
+      if (is_zapped() || MailBoxTable[mboxTableSlot].isReleased)
+      {
+         return -3;
+      }
+
+      // record where a sender can hand the message off to
+      CurrentProc->msg_buf = msg_ptr;
+      CurrentProc->buf_size = msg_size;
+      CurrentProc->wantsRef = wantsRef;
+      CurrentProc->msg_size = -1;
+
       addToWaitingList(mboxTableSlot);
-      block_me(11);
+
+      // a sender blocked on a zero slot box can now rendezvous with us
+      disableInterrupts();
+      if (MailBoxTable[mboxTableSlot].numBlocked > 0)
+      {
+         unblock_proc(popBlocked(mboxTableSlot));
+      }
+      enableInterrupts();
+
+      TRACE(TRACE_MBOX_BLOCK, mbox_id, 1);
+      block_me(MBOX_BLOCKED);
+
+      leaveBox(mboxTableSlot);
+      if (CurrentProc->released)
+      {
+         CurrentProc->released = 0;
+         return -3;
+      }
+
+      if (CurrentProc->msg_size == HANDOFF_REFUSED)
+      {
+         CurrentProc->msg_size = -1;
+         return -1; // the message that came didn't fit msg_ptr
+      }
+
+      if (CurrentProc->msg_size != -1)
+      {
+         int handed_size = CurrentProc->msg_size;
+         CurrentProc->msg_size = -1;
+         TRACE(TRACE_MBOX_RECEIVE, mbox_id, handed_size);
+         add_msg_stats(0, handed_size);
+         return handed_size;
+      }
    }
 
-   if (is_zapped() || MailBoxTable[mboxTableSlot].isReleased)
+   // the box may have been released and cleared while we were blocked
+   if (is_zapped() || MailBoxTable[mboxTableSlot].isReleased ||
+       MailBoxTable[mboxTableSlot].first_slot == NULL)
    {
       return -3;
    }
 
-   if (MailBoxTable[mboxTableSlot].first_slot->messageSize > msg_size)
+   slot_ptr first = MailBoxTable[mboxTableSlot].first_slot;
+
+   if (first->messageSize > msg_size || (wantsRef && !first->isRef))
    {
       return -1;
    }
 
    disableInterrupts();
-   int received_msg_size = MailBoxTable[mboxTableSlot].first_slot->messageSize;
-   memcpy(msg_ptr, MailBoxTable[mboxTableSlot].first_slot->message, msg_size);
+   int received_msg_size = first->messageSize;
+   if (wantsRef)
+      *(void **)msg_ptr = first->message;
+   else
+      memcpy(msg_ptr, first->message, received_msg_size);
    removeMSG(mboxTableSlot);
 
    if (MailBoxTable[mboxTableSlot].numBlocked > 0 && MailBoxTable[mboxTableSlot].unused_slots > 0)
    {
-      int blocked_pid = MailBoxTable[mboxTableSlot].blockedProc->pid;
-      mbox_proc_ptr old = MailBoxTable[mboxTableSlot].blockedProc;
-
-      // Advance the queue
-      MailBoxTable[mboxTableSlot].blockedProc = MailBoxTable[mboxTableSlot].blockedProc->next;
-      MailBoxTable[mboxTableSlot].numBlocked--;
-      old->next = NULL;
-
-      enableInterrupts();
-
-      unblock_proc(blocked_pid);
+      unblock_proc(popBlocked(mboxTableSlot));
    }
+   enableInterrupts();
+   TRACE(TRACE_MBOX_RECEIVE, mbox_id, received_msg_size);
+   add_msg_stats(0, received_msg_size);
 
    return received_msg_size;
 
-} /* MboxReceive */
+} /* receiveMSG */
 
 /* ------------------------------------------------------------------------
    Name - MboxCondSend
@@ -357,12 +571,7 @@ int MboxReceive(int mbox_id, void *msg_ptr, int msg_size)
 int MboxCondSend(int mbox_id, void *message, int msg_size)
 {
    check_kernel_mode();
-   handleProc();
 
-   if (mail_slots_used >= MAXSLOTS)
-   {
-      return -2;
-   }
    int mboxTableSlot = getSlot(mbox_id);
 
    if (mboxTableSlot == -1)
@@ -375,63 +584,164 @@ int MboxCondSend(int mbox_id, void *message, int msg_size)
       return -1;
    }
 
-   /*Block the process if theres no space to queue and no procs waiting */
-   if (MailBoxTable[mboxTableSlot].unused_slots == 0)
+   // an interrupt handler sends for the device, not the proc it interrupted
+   if ((is_zapped() && !postingDeviceStatus) || MailBoxTable[mboxTableSlot].isReleased)
+   {
+      return -3;
+   }
+
+   disableInterrupts();
+
+   // Rendezvous with a waiting receiver, no slot needed
+   if (handOff(mboxTableSlot, message, msg_size, 0))
+   {
+      enableInterrupts();
+      TRACE(TRACE_MBOX_SEND, mbox_id, msg_size);
+      add_msg_stats(1, msg_size);
+      return 0;
+   }
+
+   /* Don't block if theres no space to queue, allocMailSlot covers the
+    * system running out of slots */
+   if (MailBoxTable[mboxTableSlot].unused_slots <= 0)
    {
+      enableInterrupts();
       return -2;
    }
 
-   if (is_zapped() || MailBoxTable[mboxTableSlot].isReleased)
+   int slotTableIndex = allocMailSlot();
+
+   if (slotTableIndex == -1)
    {
-      return -3;
+      enableInterrupts();
+      return -2;
    }
 
-   disableInterrupts();
-   int slotTableIndex = nextOpenMailSlot();
+   if (fillSlot(mboxTableSlot, slotTableIndex, message, msg_size, 0) == -1)
+   {
+      releaseMailSlot(slotTableIndex);
+      enableInterrupts();
+      return -2;
+   }
 
-   MailSlotTable[slotTableIndex].isOccupied = 1;
-   MailSlotTable[slotTableIndex].index = slotTableIndex;
-   MailSlotTable[slotTableIndex].mbox_id = MailBoxTable[mboxTableSlot].mbox_id;
-   MailSlotTable[slotTableIndex].messageSize = msg_size;
-   MailSlotTable[slotTableIndex].next_in_box = NULL;                 // make sure thee's nothing in the next field yet
-   memcpy(MailSlotTable[slotTableIndex].message, message, msg_size); // Put the message in the slot
+   // Put the mailslot at the end of the mailbox
+   appendMSG(mboxTableSlot, slotTableIndex);
 
-   // Put the mailslot in the appropriate place in the mailbox
-   if (MailBoxTable[mboxTableSlot].first_slot == NULL)
+   // Wake up the next waiting process
+   if (MailBoxTable[mboxTableSlot].numWaiting > 0)
    {
-      MailBoxTable[mboxTableSlot].first_slot = &MailSlotTable[slotTableIndex];
+      unblock_proc(popWaiting(mboxTableSlot));
    }
-   else
+   enableInterrupts();
+   TRACE(TRACE_MBOX_SEND, mbox_id, msg_size);
+   add_msg_stats(1, msg_size);
+
+   return 0;
+} /*MboxCondSend*/
+
+/* ------------------------------------------------------------------------
+   Name - MboxReserve
+   Purpose - Sets a slot of a mailbox aside for a message that will be
+             sent later with MboxSendReserved, so a sender that must not
+             block or fail then (an interrupt driven completion) can find
+             out now that the box has no room.
+   Parameters - mailbox id.
+   Returns - the reservation, -1 if invalid args or the mailbox was
+             released, -2 if the mailbox is full or the system is out of
+             slots.
+   Side Effects - the slot counts against the mailbox until it is sent.
+   ----------------------------------------------------------------------- */
+int MboxReserve(int mbox_id)
+{
+   check_kernel_mode();
+
+   int mboxTableSlot = getSlot(mbox_id);
+
+   if (mboxTableSlot == -1 || MailBoxTable[mboxTableSlot].isReleased)
    {
+      return -1;
+   }
 
-      slot_ptr curSlot = MailBoxTable[mboxTableSlot].first_slot;
-      // Find the end of the linked list
-      while (curSlot->next_in_box != NULL)
-      {
-         curSlot = curSlot->next_in_box;
-      }
-      // add to the end of the linked list
-      curSlot->next_in_box = &MailSlotTable[slotTableIndex];
+   disableInterrupts();
+
+   if (MailBoxTable[mboxTableSlot].unused_slots <= 0)
+   {
+      enableInterrupts();
+      return -2;
+   }
+
+   int slotTableIndex = allocMailSlot();
+
+   if (slotTableIndex == -1)
+   {
+      enableInterrupts();
+      return -2;
    }
 
    MailBoxTable[mboxTableSlot].unused_slots--;
+   enableInterrupts();
 
-   // Wake up the next waiting process
-   if (MailBoxTable[mboxTableSlot].numWaiting > 0)
+   return slotTableIndex;
+} /*MboxReserve*/
+
+/* ------------------------------------------------------------------------
+   Name - MboxSendReserved
+   Purpose - Sends a message using a slot set aside by MboxReserve. Never
+             blocks and never finds the mailbox full.
+   Parameters - mailbox id, the reservation, pointer to data of msg,
+             # of bytes in msg.
+   Returns - zero if successful, -1 if invalid args or the mailbox was
+             released since the reservation was made.
+   Side Effects - the reservation is used up either way.
+   ----------------------------------------------------------------------- */
+int MboxSendReserved(int mbox_id, int reservation, void *message, int msg_size)
+{
+   check_kernel_mode();
+
+   int mboxTableSlot = getSlot(mbox_id);
+
+   disableInterrupts();
+
+   // a released box took its slot counts with it, only the mail slot is left
+   if (mboxTableSlot == -1 || MailBoxTable[mboxTableSlot].isReleased)
+   {
+      releaseMailSlot(reservation);
+      enableInterrupts();
+      return -1;
+   }
+
+   // Give the set aside slot back to the box, the message takes it again
+   MailBoxTable[mboxTableSlot].unused_slots++;
+
+   if (msg_size > MailBoxTable[mboxTableSlot].slot_size)
    {
-      int waiting_pid = MailBoxTable[mboxTableSlot].waitingProc->pid;
-      mbox_proc_ptr old = MailBoxTable[mboxTableSlot].waitingProc;
+      releaseMailSlot(reservation);
+      enableInterrupts();
+      return -1;
+   }
 
-      // Advance the queue
-      MailBoxTable[mboxTableSlot].waitingProc = MailBoxTable[mboxTableSlot].waitingProc->next;
-      MailBoxTable[mboxTableSlot].numWaiting--;
-      old->next = NULL;
-      unblock_proc(waiting_pid);
+   // Rendezvous with a waiting receiver, no slot needed
+   if (handOff(mboxTableSlot, message, msg_size, 0))
+   {
+      releaseMailSlot(reservation);
+   }
+   else if (fillSlot(mboxTableSlot, reservation, message, msg_size, 0) == -1)
+   {
+      releaseMailSlot(reservation);
+      enableInterrupts();
+      return -1;
+   }
+   else
+   {
+      appendMSG(mboxTableSlot, reservation);
    }
+
    enableInterrupts();
+   TRACE(TRACE_MBOX_SEND, mbox_id, msg_size);
+   add_msg_stats(1, msg_size);
 
    return 0;
-} /*MboxCondSend*/
+} /*MboxSendReserved*/
 
 /* ------------------------------------------------------------------------
  Name - MboxCondReceive
@@ -446,7 +756,6 @@ Side Effects - none.
 int MboxCondReceive(int mbox_id, void *message, int msg_size)
 {
    check_kernel_mode();
-   handleProc();
 
    int mboxTableSlot = getSlot(mbox_id);
 
@@ -465,62 +774,364 @@ int MboxCondReceive(int mbox_id, void *message, int msg_size)
       return -3;
    }
 
-   if (MailBoxTable[mboxTableSlot].first_slot->messageSize > msg_size)
+   slot_ptr first = MailBoxTable[mboxTableSlot].first_slot;
+
+   if (first->messageSize > msg_size)
    {
       return -1;
    }
 
    disableInterrupts();
-   int received_msg_size = MailBoxTable[mboxTableSlot].first_slot->messageSize;
-   memcpy(message, MailBoxTable[mboxTableSlot].first_slot->message, msg_size);
+   int received_msg_size = first->messageSize;
+   memcpy(message, first->message, received_msg_size);
    removeMSG(mboxTableSlot);
 
    if (MailBoxTable[mboxTableSlot].numBlocked > 0 && MailBoxTable[mboxTableSlot].unused_slots > 0)
    {
-      int blocked_pid = MailBoxTable[mboxTableSlot].blockedProc->pid;
-      mbox_proc_ptr old = MailBoxTable[mboxTableSlot].blockedProc;
-
-      // Advance the queue
-      MailBoxTable[mboxTableSlot].blockedProc = MailBoxTable[mboxTableSlot].blockedProc->next;
-      MailBoxTable[mboxTableSlot].numBlocked--;
-      old->next = NULL;
-
-      enableInterrupts();
-
-      unblock_proc(blocked_pid);
+      unblock_proc(popBlocked(mboxTableSlot));
    }
+   enableInterrupts();
+   TRACE(TRACE_MBOX_RECEIVE, mbox_id, received_msg_size);
+   add_msg_stats(0, received_msg_size);
+
    return received_msg_size;
 } /*MboxCondReceive*/
 
-int check_io()
+/* ------------------------------------------------------------------------
+   Name - MboxSendMany
+   Purpose - Sends up to count messages to a mailbox in one call. Blocks
+             like MboxSend until the first message fits, then sends the
+             rest until the mailbox fills. Waiting receivers are handed
+             messages directly, so none are left waiting once one is
+             queued.
+   Parameters - mailbox id, array of count message pointers, array of
+                their sizes, # of messages.
+   Returns - # of messages sent, -1 if invalid args, -2 if the system is
+             out of mail slots before any were sent, -3 if zapped or the
+             mailbox was released.
+   Side Effects - none.
+   ----------------------------------------------------------------------- */
+int MboxSendMany(int mbox_id, void **msgs, int *sizes, int count)
 {
-   return 0;
-}
+   check_kernel_mode();
 
-/*
- * Checks if process is in kernel mode. Does nothing if it is, prints
- * an error and halts if the process is not in kernel mode.
- */
-void check_kernel_mode()
-{
-   if ((PSR_CURRENT_MODE & psr_get()) == 0)
+   int mboxTableSlot = getSlot(mbox_id);
+
+   if (mboxTableSlot == -1 || msgs == NULL || sizes == NULL || count <= 0)
    {
-      console("Kernel Error: Not in kernel mode.\n");
-      halt(1);
+      return -1;
    }
-} /*check_kernel_mode*/
 
-/*
- * Enables the interrupts
- */
-void enableInterrupts()
-{
-   /* turn the interrupts OPN iff we are in kernel mode */
-   if ((PSR_CURRENT_MODE & psr_get()) == 0)
+   mail_box *box = &MailBoxTable[mboxTableSlot];
+
+   for (int i = 0; i < count; i++)
    {
-      // not in kernel mode
-      console("Kernel Error: Not in kernel mode, may not enable interrupts\n");
-      halt(1);
+      if (sizes[i] < 0 || sizes[i] > box->slot_size)
+      {
+         return -1;
+      }
+   }
+
+   int sent = 0;
+   int outOfSlots = 0;
+
+   if (is_zapped() || box->isReleased)
+   {
+      return -3;
+   }
+
+   disableInterrupts();
+
+   while (sent < count)
+   {
+      // Rendezvous with a waiting receiver, no slot needed
+      if (handOff(mboxTableSlot, msgs[sent], sizes[sent], 0))
+      {
+         TRACE(TRACE_MBOX_SEND, mbox_id, sizes[sent]);
+         add_msg_stats(1, sizes[sent]);
+         sent++;
+         continue;
+      }
+
+      if (box->unused_slots <= 0)
+      {
+         if (sent > 0)
+         {
+            break;
+         }
+
+         /*Block the process until the first message can go somewhere */
+         enableInterrupts();
+         addToBlockedList(mboxTableSlot);
+         notifySenderBlocked(mboxTableSlot);
+         TRACE(TRACE_MBOX_BLOCK, mbox_id, 0);
+         block_me(MBOX_BLOCKED);
+
+         leaveBox(mboxTableSlot);
+         if (CurrentProc->released)
+         {
+            CurrentProc->released = 0;
+            return -3;
+         }
+         if (is_zapped())
+         {
+            return -3;
+         }
+         disableInterrupts();
+         continue;
+      }
+
+      int slotTableIndex = allocMailSlot();
+
+      if (slotTableIndex == -1)
+      {
+         outOfSlots = 1;
+         break;
+      }
+
+      if (fillSlot(mboxTableSlot, slotTableIndex, msgs[sent], sizes[sent], 0) == -1)
+      {
+         releaseMailSlot(slotTableIndex);
+         outOfSlots = 1;
+         break;
+      }
+
+      appendMSG(mboxTableSlot, slotTableIndex);
+      TRACE(TRACE_MBOX_SEND, mbox_id, sizes[sent]);
+      add_msg_stats(1, sizes[sent]);
+      sent++;
+   }
+   enableInterrupts();
+
+   if (sent == 0 && outOfSlots)
+   {
+      return -2;
+   }
+   return sent;
+} /*MboxSendMany*/
+
+/* ------------------------------------------------------------------------
+   Name - MboxReceiveMany
+   Purpose - Receives up to count messages from a mailbox in one call.
+             Blocks like MboxReceive until the first message arrives, then
+             takes queued messages until the mailbox is empty. Blocked
+             senders are woken once at the end, one per freed slot.
+   Parameters - mailbox id, array of count buffers, array holding the size
+                of each buffer. Each size is replaced with the size of the
+                message received into that buffer.
+   Returns - # of messages received, -1 if invalid args or the first
+             message doesn't fit, -3 if zapped or the mailbox was released.
+   Side Effects - none.
+   ----------------------------------------------------------------------- */
+int MboxReceiveMany(int mbox_id, void **bufs, int *sizes, int count)
+{
+   check_kernel_mode();
+
+   int mboxTableSlot = getSlot(mbox_id);
+
+   if (mboxTableSlot == -1 || bufs == NULL || sizes == NULL || count <= 0)
+   {
+      return -1;
+   }
+
+   mail_box *box = &MailBoxTable[mboxTableSlot];
+   int received = 0;
+
+   if (is_zapped() || box->isReleased)
+   {
+      return -3;
+   }
+
+   // nothing queued, wait for the first message the usual way
+   if (box->first_slot == NULL)
+   {
+      int result = receiveMSG(mbox_id, bufs[0], sizes[0], 0);
+      if (result < 0)
+      {
+         return result;
+      }
+      sizes[0] = result;
+      received = 1;
+   }
+
+   disableInterrupts();
+
+   int freed = 0;
+
+   while (received < count && box->first_slot != NULL)
+   {
+      slot_ptr first = box->first_slot;
+
+      // stop short at a message that doesn't fit, it stays queued
+      if (first->messageSize > sizes[received] || first->isRef)
+      {
+         break;
+      }
+
+      memcpy(bufs[received], first->message, first->messageSize);
+      sizes[received] = first->messageSize;
+      removeMSG(mboxTableSlot);
+      TRACE(TRACE_MBOX_RECEIVE, mbox_id, sizes[received]);
+      add_msg_stats(0, sizes[received]);
+      received++;
+      freed++;
+   }
+
+   // Wake one blocked sender per freed slot
+   while (freed > 0 && box->numBlocked > 0 && box->unused_slots > 0)
+   {
+      unblock_proc(popBlocked(mboxTableSlot));
+      freed--;
+   }
+   enableInterrupts();
+
+   if (received == 0)
+   {
+      return -1;
+   }
+   return received;
+} /*MboxReceiveMany*/
+
+/* ------------------------------------------------------------------------
+   Name - MboxSelect
+   Purpose - Waits until any of the given mailboxes has a message. The
+             message is left in the box for the caller to receive. A
+             zero slot box is ready when a sender is blocked on it.
+   Parameters - array of mailbox ids, # of ids (at most MAX_SELECT), time
+                to wait in microseconds (0 to poll, -1 to wait forever).
+   Returns - id of a mailbox with a message, -1 if invalid args, -2 if
+             the timeout expired, -3 if zapped or a box was released.
+   Side Effects - the caller blocks until a message arrives.
+   ----------------------------------------------------------------------- */
+int MboxSelect(int *ids, int n, int timeout_us)
+{
+   check_kernel_mode();
+
+   if (ids == NULL || n <= 0 || n > MAX_SELECT)
+   {
+      return -1;
+   }
+
+   disableInterrupts();
+
+   // check for a message that is already there
+   for (int i = 0; i < n; i++)
+   {
+      int slot = getSlot(ids[i]);
+      if (slot == -1)
+      {
+         enableInterrupts();
+         return -1;
+      }
+      if (selectable(slot))
+      {
+         enableInterrupts();
+         return ids[i];
+      }
+   }
+
+   if (timeout_us == 0)
+   {
+      enableInterrupts();
+      return -2;
+   }
+
+   if (is_zapped())
+   {
+      enableInterrupts();
+      return -3;
+   }
+
+   // register on the selector list of every box
+   CurrentProc->selectReady = 0;
+   CurrentProc->numSelecting = n;
+   CurrentProc->selectStart = sys_clock();
+   CurrentProc->selectTimeout = timeout_us;
+   for (int i = 0; i < n; i++)
+   {
+      selectNode *node = &CurrentProc->selectNodes[i];
+      int slot = getSlot(ids[i]);
+
+      // append, so selectors are woken in the order they arrived
+      node->proc = CurrentProc;
+      node->boxSlot = slot;
+      node->next = NULL;
+      node->prev = MailBoxTable[slot].lastSelector;
+      if (node->prev != NULL)
+         node->prev->next = node;
+      else
+         MailBoxTable[slot].selectors = node;
+      MailBoxTable[slot].lastSelector = node;
+      MailBoxTable[slot].numSelectors++;
+   }
+   if (timeout_us > 0)
+   {
+      addTimedSelector(CurrentProc);
+   }
+
+   block_me(SELECT_BLOCKED);
+
+   // take ourselves off every box that is still around
+   disableInterrupts();
+   for (int i = 0; i < n; i++)
+   {
+      selectNode *node = &CurrentProc->selectNodes[i];
+
+      if (node->boxSlot == -1)
+      {
+         continue;
+      }
+      if (node->prev != NULL)
+         node->prev->next = node->next;
+      else
+         MailBoxTable[node->boxSlot].selectors = node->next;
+      if (node->next != NULL)
+         node->next->prev = node->prev;
+      else
+         MailBoxTable[node->boxSlot].lastSelector = node->prev;
+      MailBoxTable[node->boxSlot].numSelectors--;
+   }
+   removeTimedSelector(CurrentProc);
+   CurrentProc->numSelecting = 0;
+   int ready = CurrentProc->selectReady;
+   enableInterrupts();
+
+   if (is_zapped())
+   {
+      return -3;
+   }
+   return ready;
+} /* MboxSelect */
+
+int check_io()
+{
+   return 0;
+}
+
+/*
+ * Checks if process is in kernel mode. Does nothing if it is, prints
+ * an error and halts if the process is not in kernel mode.
+ */
+void check_kernel_mode()
+{
+   if ((PSR_CURRENT_MODE & psr_get()) == 0)
+   {
+      console("Kernel Error: Not in kernel mode.\n");
+      halt(1);
+   }
+} /*check_kernel_mode*/
+
+/*
+ * Enables the interrupts
+ */
+void enableInterrupts()
+{
+   /* turn the interrupts OPN iff we are in kernel mode */
+   if ((PSR_CURRENT_MODE & psr_get()) == 0)
+   {
+      // not in kernel mode
+      console("Kernel Error: Not in kernel mode, may not enable interrupts\n");
+      halt(1);
    }
    else
    {
@@ -582,8 +1193,13 @@ int assignMailBoxID()
  */
 int getSlot(int mboxID)
 {
+   if (mboxID <= 0)
+   {
+      return -1;
+   }
+
    int slot = mboxID % MAXMBOX;
-   if (MailBoxTable[slot].mbox_id == 0)
+   if (MailBoxTable[slot].mbox_id != mboxID)
    {
       return -1;
    }
@@ -603,29 +1219,99 @@ void freeSlots(int tableSlot)
    {
       temp = cur;
       cur = cur->next_in_box;
-      memset(temp, 0, sizeof(MailBoxTable[0])); // free the slot
-      mail_slots_used--;
+      releaseMailSlot(temp->index); // free the slot
    }
 
 } /* freeSlots*/
 
 /*
- * Returns the index of the next open mail slot within the
- * MailSlotTable
+ * Pops a free mail slot off the free slot stack and marks it occupied.
+ * Returns the index of the slot within the MailSlotTable, or -1 if
+ * every slot is in use.
  */
-int nextOpenMailSlot()
+int allocMailSlot()
 {
-   for (int i = 0; i < MAXSLOTS; i++)
+   if (freeSlotTop == 0)
    {
-      if (MailSlotTable[i].isOccupied == 0)
-      {
-         return i;
-      }
+      mail_slot_alloc_failures++;
+      return -1;
+   }
+
+   int index = freeSlotStack[--freeSlotTop];
+
+   MailSlotTable[index].isOccupied = 1;
+   MailSlotTable[index].index = index;
+   MailSlotTable[index].sizeClass = -1;
+   MailSlotTable[index].message = NULL;
+   MailSlotTable[index].next_in_box = NULL;
+   MailSlotTable[index].prev_in_box = NULL;
+
+   mail_slots_used++;
+   if (mail_slots_used > mail_slots_high_water)
+   {
+      mail_slots_high_water = mail_slots_used;
    }
 
-   return -1; // Will only be returned if there is MAXSLOTS slots
+   return index;
+} /*allocMailSlot*/
 
-} /*nextOpenMailSlot*/
+/*
+ * Reports how the slot allocator has done: slots in use now, the most
+ * ever in use at once, sends that failed for want of a slot or payload,
+ * and payloads that overflowed their pools onto the heap. Any of the
+ * pointers may be NULL.
+ */
+void get_slot_stats(int *inUse, int *highWater, int *failures, int *heapAllocs)
+{
+   if (inUse != NULL)
+      *inUse = mail_slots_used;
+   if (highWater != NULL)
+      *highWater = mail_slots_high_water;
+   if (failures != NULL)
+      *failures = mail_slot_alloc_failures;
+   if (heapAllocs != NULL)
+      *heapAllocs = payload_heap_allocs;
+} /*get_slot_stats*/
+
+/*
+ * Prints the slot allocator counters and how full each payload pool is.
+ */
+void dump_mbox_stats()
+{
+   console("MAIL SLOTS IN USE: %d of %d \n", mail_slots_used, MAXSLOTS);
+   console("MAIL SLOTS HIGH WATER: %d \n", mail_slots_high_water);
+   console("MAIL SLOT ALLOC FAILURES: %d \n", mail_slot_alloc_failures);
+   console("PAYLOAD HEAP ALLOCS: %d \n", payload_heap_allocs);
+   for (int c = 0; c < NUM_SIZE_CLASSES; c++)
+   {
+      console("PAYLOAD POOL %d (%d bytes): %d of %d free \n", c, PayloadPools[c].bufSize,
+              PayloadPools[c].freeTop, PayloadPools[c].numBufs);
+   }
+} /*dump_mbox_stats*/
+
+/*
+ * Returns the mail slot at the given index to the free slot stack,
+ * along with its payload buffer if it has one.
+ */
+void releaseMailSlot(int index)
+{
+   if (MailSlotTable[index].sizeClass != -1)
+   {
+      freePayload(MailSlotTable[index].sizeClass, MailSlotTable[index].message);
+   }
+
+   MailSlotTable[index].isOccupied = 0;
+   MailSlotTable[index].mbox_id = 0;
+   MailSlotTable[index].messageSize = 0;
+   MailSlotTable[index].isRef = 0;
+   MailSlotTable[index].sizeClass = -1;
+   MailSlotTable[index].message = NULL;
+   MailSlotTable[index].next_in_box = NULL;
+   MailSlotTable[index].prev_in_box = NULL;
+
+   freeSlotStack[freeSlotTop++] = index;
+   mail_slots_used--;
+} /*releaseMailSlot*/
 
 /*
  * Removes the first message from a mailbox and advances to the next.
@@ -643,11 +1329,183 @@ void removeMSG(int mBoxTableSlot)
 
    // first_slot becomes next
    MailBoxTable[mBoxTableSlot].first_slot = MailBoxTable[mBoxTableSlot].first_slot->next_in_box;
-   memset(&MailSlotTable[slotIndex], 0, sizeof(MailBoxTable[0])); // free the slot
+   if (MailBoxTable[mBoxTableSlot].first_slot == NULL)
+   {
+      MailBoxTable[mBoxTableSlot].last_slot = NULL;
+   }
+   releaseMailSlot(slotIndex); // free the slot
    MailBoxTable[mBoxTableSlot].unused_slots++;
-   mail_slots_used--;
 } /*removeMSG*/
 
+/*
+ * Fills in a freshly allocated mail slot with a message for the mailbox
+ * at mBoxTableSlot. By reference messages only keep the pointer.
+ * Returns -1 if no payload buffer is left for the message, 0 otherwise.
+ */
+int fillSlot(int mBoxTableSlot, int slotIndex, void *msg, int msg_size, int isRef)
+{
+   MailSlotTable[slotIndex].mbox_id = MailBoxTable[mBoxTableSlot].mbox_id;
+   MailSlotTable[slotIndex].messageSize = msg_size;
+   MailSlotTable[slotIndex].isRef = isRef;
+
+   if (isRef)
+   {
+      MailSlotTable[slotIndex].message = msg;
+   }
+   else if (msg_size > 0)
+   {
+      int sizeClass = allocPayload(msg_size, &MailSlotTable[slotIndex].message);
+      if (sizeClass == -1)
+      {
+         mail_slot_alloc_failures++;
+         return -1;
+      }
+      MailSlotTable[slotIndex].sizeClass = sizeClass;
+      memcpy(MailSlotTable[slotIndex].message, msg, msg_size); // Put the message in the slot
+   }
+
+   return 0;
+} /*fillSlot*/
+
+/*
+ * Sets up the payload pools for every size class with all buffers free.
+ */
+void initPayloadPools()
+{
+   PayloadPools[0].bufSize = SMALL_MSG_SIZE;
+   PayloadPools[0].numBufs = MAXSLOTS;
+   PayloadPools[0].buffers = &smallPayloads[0][0];
+   PayloadPools[0].freeStack = smallFree;
+
+   PayloadPools[1].bufSize = MEDIUM_MSG_SIZE;
+   PayloadPools[1].numBufs = MAXSLOTS / 2;
+   PayloadPools[1].buffers = &mediumPayloads[0][0];
+   PayloadPools[1].freeStack = mediumFree;
+
+   PayloadPools[2].bufSize = MAX_MESSAGE;
+   PayloadPools[2].numBufs = MAXSLOTS / 4;
+   PayloadPools[2].buffers = &largePayloads[0][0];
+   PayloadPools[2].freeStack = largeFree;
+
+   for (int c = 0; c < NUM_SIZE_CLASSES; c++)
+   {
+      for (int i = 0; i < PayloadPools[c].numBufs; i++)
+      {
+         PayloadPools[c].freeStack[i] = i;
+      }
+      PayloadPools[c].freeTop = PayloadPools[c].numBufs;
+   }
+} /*initPayloadPools*/
+
+/*
+ * Takes a buffer for a msg_size byte message from the smallest size class
+ * that fits and has one free, or from the heap if every class that fits
+ * is exhausted. Stores the buffer in *buf and returns its size class,
+ * or -1 if even the heap is out of memory.
+ */
+int allocPayload(int msg_size, char **buf)
+{
+   for (int c = 0; c < NUM_SIZE_CLASSES; c++)
+   {
+      payloadPool *pool = &PayloadPools[c];
+
+      if (msg_size <= pool->bufSize && pool->freeTop > 0)
+      {
+         int i = pool->freeStack[--pool->freeTop];
+         *buf = pool->buffers + (i * pool->bufSize);
+         return c;
+      }
+   }
+
+   *buf = malloc(msg_size);
+   if (*buf == NULL)
+   {
+      return -1;
+   }
+   payload_heap_allocs++;
+
+   return HEAP_SIZE_CLASS;
+} /*allocPayload*/
+
+/*
+ * Returns a payload buffer to the pool of the given size class.
+ */
+void freePayload(int sizeClass, char *buf)
+{
+   if (sizeClass == HEAP_SIZE_CLASS)
+   {
+      free(buf);
+      return;
+   }
+
+   payloadPool *pool = &PayloadPools[sizeClass];
+
+   pool->freeStack[pool->freeTop++] = (buf - pool->buffers) / pool->bufSize;
+} /*freePayload*/
+
+/*
+ * Hands a message straight to the first proc waiting on the mailbox at
+ * mBoxTableSlot, skipping the slot table. Returns 1 and wakes the
+ * receiver if the handoff happened, 0 if the message must be queued.
+ * Waiting receivers that can't take the message have their receive
+ * failed with -1 on the way, rather than being left waiting on a zero
+ * slot box forever.
+ */
+int handOff(int mBoxTableSlot, void *msg, int msg_size, int isRef)
+{
+   mbox_proc_ptr receiver = MailBoxTable[mBoxTableSlot].waitingProc;
+
+   while (receiver != NULL &&
+          (msg_size > receiver->buf_size || (receiver->wantsRef && !isRef)))
+   {
+      receiver->msg_size = HANDOFF_REFUSED;
+      unblock_proc(popWaiting(mBoxTableSlot));
+      receiver = MailBoxTable[mBoxTableSlot].waitingProc;
+   }
+
+   if (receiver == NULL)
+   {
+      return 0;
+   }
+
+   if (receiver->wantsRef)
+      *(void **)receiver->msg_buf = msg;
+   else
+      memcpy(receiver->msg_buf, msg, msg_size);
+
+   receiver->msg_size = msg_size;
+   unblock_proc(popWaiting(mBoxTableSlot));
+
+   return 1;
+} /*handOff*/
+
+/*
+ * Adds the mail slot at slotIndex to the end of the message queue of
+ * the mailbox at mBoxTableSlot.
+ */
+void appendMSG(int mBoxTableSlot, int slotIndex)
+{
+   slot_ptr newSlot = &MailSlotTable[slotIndex];
+
+   if (MailBoxTable[mBoxTableSlot].last_slot == NULL)
+   {
+      MailBoxTable[mBoxTableSlot].first_slot = newSlot;
+   }
+   else
+   {
+      newSlot->prev_in_box = MailBoxTable[mBoxTableSlot].last_slot;
+      MailBoxTable[mBoxTableSlot].last_slot->next_in_box = newSlot;
+   }
+   MailBoxTable[mBoxTableSlot].last_slot = newSlot;
+   MailBoxTable[mBoxTableSlot].unused_slots--;
+
+   // boxes nobody selects on only pay for this check
+   if (MailBoxTable[mBoxTableSlot].numSelectors > 0)
+   {
+      notifySelectors(mBoxTableSlot, MailBoxTable[mBoxTableSlot].mbox_id);
+   }
+} /*appendMSG*/
+
 /*
  * Adds the current process to the waiting queue of the mailbox
  * that is at index mBoxTableSlot
@@ -655,80 +1513,172 @@ void removeMSG(int mBoxTableSlot)
 void addToWaitingList(int mBoxTableSlot)
 {
    disableInterrupts();
-   if (MailBoxTable[mBoxTableSlot].waitingProc == NULL)
+   mbox_proc_ptr theProc = &MBoxProcTable[CurrentProc->index];
+
+   theProc->next = NULL;
+   theProc->status = 1;
+   if (MailBoxTable[mBoxTableSlot].lastWaiting == NULL)
    {
-      MailBoxTable[mBoxTableSlot].waitingProc = &MBoxProcTable[CurrentProc->index];
+      MailBoxTable[mBoxTableSlot].waitingProc = theProc;
    }
    else
    {
-      mbox_proc_ptr cur = MailBoxTable[mBoxTableSlot].waitingProc;
-      while (cur->next != NULL)
-      {
-         cur = cur->next;
-      }
-      cur->next = &MBoxProcTable[CurrentProc->index];
+      MailBoxTable[mBoxTableSlot].lastWaiting->next = theProc;
    }
+   MailBoxTable[mBoxTableSlot].lastWaiting = theProc;
 
    MailBoxTable[mBoxTableSlot].numWaiting++;
    enableInterrupts();
 } /*addToWaitingList*/
 
 /*Adds the current proc to the blocked list of the mailbox in the given slot*/
-void addToBlockedList(int mBoxTableSlot)
+static void addToBlockedList(int mBoxTableSlot)
 {
    disableInterrupts();
-   if (MailBoxTable[mBoxTableSlot].blockedProc == NULL)
+   mbox_proc_ptr theProc = &MBoxProcTable[CurrentProc->index];
+
+   theProc->next = NULL;
+   theProc->status = 2;
+   if (MailBoxTable[mBoxTableSlot].lastBlocked == NULL)
    {
-      MailBoxTable[mBoxTableSlot].blockedProc = &MBoxProcTable[CurrentProc->index];
+      MailBoxTable[mBoxTableSlot].blockedProc = theProc;
    }
    else
    {
-      mbox_proc_ptr cur = MailBoxTable[mBoxTableSlot].blockedProc;
-      while (cur->next != NULL)
-      {
-         cur = cur->next;
-      }
-      cur->next = &MBoxProcTable[CurrentProc->index];
+      MailBoxTable[mBoxTableSlot].lastBlocked->next = theProc;
    }
+   MailBoxTable[mBoxTableSlot].lastBlocked = theProc;
 
    MailBoxTable[mBoxTableSlot].numBlocked++;
    enableInterrupts();
 } /*addToBlockedList*/
 
 /*
- * Checks to see if the current process is already in the table.
- * If the current process is in the table already nothing happens.
- * If it is not, the process is added to the table.
- * Also updates Current.
+ * Removes the first proc from the waiting list of the mailbox in the
+ * given slot. Returns the pid of the removed proc.
+ */
+int popWaiting(int mBoxTableSlot)
+{
+   mbox_proc_ptr old = MailBoxTable[mBoxTableSlot].waitingProc;
+
+   // Advance the queue
+   MailBoxTable[mBoxTableSlot].waitingProc = old->next;
+   if (MailBoxTable[mBoxTableSlot].waitingProc == NULL)
+   {
+      MailBoxTable[mBoxTableSlot].lastWaiting = NULL;
+   }
+   MailBoxTable[mBoxTableSlot].numWaiting--;
+   old->next = NULL;
+   old->status = 0;
+
+   return old->pid;
+} /*popWaiting*/
+
+/*
+ * Removes the first proc from the blocked list of the mailbox in the
+ * given slot. Returns the pid of the removed proc.
+ */
+int popBlocked(int mBoxTableSlot)
+{
+   mbox_proc_ptr old = MailBoxTable[mBoxTableSlot].blockedProc;
+
+   // Advance the queue
+   MailBoxTable[mBoxTableSlot].blockedProc = old->next;
+   if (MailBoxTable[mBoxTableSlot].blockedProc == NULL)
+   {
+      MailBoxTable[mBoxTableSlot].lastBlocked = NULL;
+   }
+   MailBoxTable[mBoxTableSlot].numBlocked--;
+   old->next = NULL;
+   old->status = 0;
+
+   return old->pid;
+} /*popBlocked*/
+
+/*
+ * Takes the current proc off the waiting or blocked list of the mailbox
+ * in the given slot if it is still on one. A proc woken by a zap rather
+ * than by a sender, receiver or release is still listed, and would
+ * otherwise be handed messages it will never receive.
  */
-void handleProc()
+static void leaveBox(int mBoxTableSlot)
 {
+   mail_box *box = &MailBoxTable[mBoxTableSlot];
+   mbox_proc_ptr *link;
+   mbox_proc_ptr prev = NULL;
+
+   if (CurrentProc->status == 0)
+   {
+      return;
+   }
 
    disableInterrupts();
-   int nextAvailableSlot = -1;
-   int current_pid = getpid();
-   for (int i = 0; i < MAXPROC; i++)
+   link = CurrentProc->status == 1 ? &box->waitingProc : &box->blockedProc;
+   while (*link != NULL && *link != CurrentProc)
    {
-      if (MBoxProcTable[i].pid == current_pid)
+      prev = *link;
+      link = &(*link)->next;
+   }
+   if (*link != NULL)
+   {
+      *link = CurrentProc->next;
+      if (CurrentProc->status == 1)
       {
-         return;
+         if (box->lastWaiting == CurrentProc)
+            box->lastWaiting = prev;
+         box->numWaiting--;
       }
-
-      // only update nextAvailableSlot if this is the first time finding a free slot
-      if (nextAvailableSlot == -1 && MBoxProcTable[i].pid == 0)
+      else
       {
-         nextAvailableSlot = i;
+         if (box->lastBlocked == CurrentProc)
+            box->lastBlocked = prev;
+         box->numBlocked--;
       }
    }
+   CurrentProc->next = NULL;
+   CurrentProc->status = 0;
+   enableInterrupts();
+} /*leaveBox*/
 
-   /* Only reached if the process is not in the table*/
-   MBoxProcTable[nextAvailableSlot].pid = current_pid;
-   MBoxProcTable[nextAvailableSlot].index = nextAvailableSlot;
-   CurrentProc = &MBoxProcTable[nextAvailableSlot];
+/*
+ * Called by fork1 when a process is created. Registers the process in
+ * the MBoxProcTable slot matching its pid.
+ */
+void p1_fork(int pid)
+{
+   int slot = pid % MAXPROC;
+
+   MBoxProcTable[slot].pid = pid;
+   MBoxProcTable[slot].status = 0;
+   MBoxProcTable[slot].index = slot;
+   MBoxProcTable[slot].next = NULL;
+   MBoxProcTable[slot].prev = NULL;
+   MBoxProcTable[slot].msg_buf = NULL;
+   MBoxProcTable[slot].released = 0;
+   MBoxProcTable[slot].msg_size = -1;
+   MBoxProcTable[slot].numSelecting = 0;
+   MBoxProcTable[slot].hasDeadline = 0;
+   MBoxProcTable[slot].nextTimed = NULL;
+   MBoxProcTable[slot].prevTimed = NULL;
+   MBoxProcTable[slot].selectNodes = SelectNodeTable[slot];
+} /*p1_fork*/
 
-   enableInterrupts();
+/*
+ * Called by the dispatcher on every context switch. Keeps CurrentProc
+ * pointing at the entry of the process being switched in.
+ */
+void p1_switch(int old, int new)
+{
+   CurrentProc = &MBoxProcTable[new % MAXPROC];
+} /*p1_switch*/
 
-} /*handleProc*/
+/*
+ * Called by quit when a process terminates. Frees its MBoxProcTable slot.
+ */
+void p1_quit(int pid)
+{
+   memset(&MBoxProcTable[pid % MAXPROC], 0, sizeof(MBoxProcTable[0]));
+} /*p1_quit*/
 
 /*
  * The sys call handler. The syscall interrupt points to this method
@@ -750,14 +1700,31 @@ void syscall_handler(int dev, void *unit)
    {
       sys_vec[callNumber](sys_ptr);
    }
+   check_preempt(); // the call may have readied a proc outranking the caller
 } /*syscall_handler*/
 
 /*
- * The handler for the clock interrupt
+ * The handler for the clock interrupt. Times out selectors and posts
+ * the time for the clock driver on every interrupt, then passes it on
+ * to phase 1 so the running proc's slice is checked. With a tickless
+ * clock interrupts only come when some phase programmed one.
  */
 void clock_handler(int dev, void *unit)
 {
+   int status;
+
+   if (timedSelectors != NULL)
+   {
+      expireSelectors();
+   }
+
+   device_input(CLOCK_DEV, 0, &status);
+   postDeviceStatus(clockBox, status);
 
+   if (phase1ClockHandler != NULL)
+   {
+      phase1ClockHandler(dev, unit);
+   }
 } /*clock_handler*/
 
 /*
@@ -769,19 +1736,43 @@ void alarm_handler(int dev, void *unit)
 } /*alarm_handler*/
 
 /*
- * The handler for the disk interrupt
+ * The handler for the disk interrupt. Posts the status of the unit's
+ * finished operation for its driver.
  */
 void disk_handler(int dev, void *unit)
 {
+   int status;
+   int unitNum = (int)unit;
 
+   if (unitNum < 0 || unitNum >= DISK_UNITS)
+   {
+      console("disk_handler(): bad unit %d.  Halting...\n", unitNum);
+      halt(1);
+   }
+
+   device_input(DISK_DEV, unitNum, &status);
+   postDeviceStatus(diskBoxes[unitNum], status);
+   check_preempt(); // the driver may outrank the proc interrupted
 } /*disk_handler*/
 
 /*
- * The handler for the term interrupt
+ * The handler for the term interrupt. Posts the terminal unit's status
+ * for its driver.
  */
 void term_handler(int dev, void *unit)
 {
+   int status;
+   int unitNum = (int)unit;
+
+   if (unitNum < 0 || unitNum >= TERM_UNITS)
+   {
+      console("term_handler(): bad unit %d.  Halting...\n", unitNum);
+      halt(1);
+   }
 
+   device_input(TERM_DEV, unitNum, &status);
+   postDeviceStatus(termBoxes[unitNum], status);
+   check_preempt();
 } /*term_handler*/
 
 /*
@@ -792,41 +1783,242 @@ void mmu_handler(int dev, void *unit)
 
 } /*mmu_handler*/
 
+/* ------------------------------------------------------------------------
+   Name - waitdevice
+   Purpose - Waits for an interrupt from a device unit.
+   Parameters - the device type (CLOCK_DEV, DISK_DEV or TERM_DEV), the
+                unit, and where to put the status the handler read.
+   Returns - 0, or -1 if the process was zapped while waiting.
+   Side Effects - halts on a bad device type or unit.
+   ----------------------------------------------------------------------- */
 int waitdevice(int type, int unit, int *status)
 {
+   int box;
+
+   check_kernel_mode();
+
+   if (type == CLOCK_DEV && unit == 0)
+   {
+      box = clockBox;
+   }
+   else if (type == DISK_DEV && unit >= 0 && unit < DISK_UNITS)
+   {
+      box = diskBoxes[unit];
+   }
+   else if (type == TERM_DEV && unit >= 0 && unit < TERM_UNITS)
+   {
+      box = termBoxes[unit];
+   }
+   else
+   {
+      console("waitdevice(): bad device %d unit %d.  Halting...\n", type, unit);
+      halt(1);
+      return -1;
+   }
+
+   if (MboxReceive(box, status, sizeof(int)) == -3)
+   {
+      return -1;
+   }
    return 0;
 } /*waitdevice*/
 
 /*
- * Zaps all procs that are waiting on the mailbox in the given slot
+ * Posts a device status on the device's mailbox for waitdevice. The
+ * proc that was interrupted may have been zapped, which must not cost
+ * the driver its interrupt. If the previous status is still unread the
+ * new one is dropped.
  */
-void zapWaiting(int mBoxTableSlot)
+static void postDeviceStatus(int box, int status)
 {
-   mbox_proc_ptr curProc = MailBoxTable[mBoxTableSlot].waitingProc;
-   mbox_proc_ptr temp;
+   postingDeviceStatus = 1;
+   MboxCondSend(box, &status, sizeof(int));
+   postingDeviceStatus = 0;
+}
 
-   while (curProc != NULL)
+/*
+ * Wakes all procs that are waiting to receive from the mailbox in the
+ * given slot, marking them so their receive returns -3
+ */
+void releaseWaiting(int mBoxTableSlot)
+{
+   while (MailBoxTable[mBoxTableSlot].waitingProc != NULL)
    {
-      zap(curProc->pid);
-      temp = curProc;
-      curProc = curProc->next;
-      temp->next = NULL;
+      mbox_proc_ptr proc = MailBoxTable[mBoxTableSlot].waitingProc;
+
+      proc->released = 1;
+      unblock_proc(popWaiting(mBoxTableSlot));
    }
-} /*zapWaiting*/
+} /*releaseWaiting*/
 
-/*Blocks all procs that are blocked on the mailbox in the given slot*/
-void unblockBlocked(int mBoxTableSlot)
+/*
+ * Wakes procs selecting on the mailbox in the given slot, reporting
+ * result to them. A new message (result is the box id) wakes only the
+ * first selector that hasn't been woken yet; a release (-3) wakes them
+ * all and detaches them from the box.
+ */
+void notifySelectors(int mBoxTableSlot, int result)
+{
+   selectNode *node = MailBoxTable[mBoxTableSlot].selectors;
+
+   while (node != NULL)
+   {
+      selectNode *next = node->next;
+
+      if (node->proc->selectReady == 0)
+      {
+         node->proc->selectReady = result;
+         unblock_proc(node->proc->pid);
+         if (result != -3)
+         {
+            return;
+         }
+      }
+      if (result == -3)
+      {
+         node->boxSlot = -1; // the box is going away
+      }
+      node = next;
+   }
+} /*notifySelectors*/
+
+/*
+ * Returns 1 if MboxSelect can return the mailbox in the given slot: a
+ * message is queued, or a sender is blocked on a zero slot box waiting
+ * for a receiver to rendezvous with.
+ */
+static int selectable(int mBoxTableSlot)
+{
+   mail_box *box = &MailBoxTable[mBoxTableSlot];
+
+   return box->first_slot != NULL || (box->num_slots == 0 && box->numBlocked > 0);
+} /*selectable*/
+
+/*
+ * Called when a sender blocks on the mailbox in the given slot. Nothing
+ * is queued on a zero slot box, so its selectors are told here instead
+ * of by appendMSG.
+ */
+static void notifySenderBlocked(int mBoxTableSlot)
+{
+   disableInterrupts();
+   if (MailBoxTable[mBoxTableSlot].num_slots == 0 &&
+       MailBoxTable[mBoxTableSlot].numSelectors > 0)
+   {
+      notifySelectors(mBoxTableSlot, MailBoxTable[mBoxTableSlot].mbox_id);
+   }
+   enableInterrupts();
+} /*notifySenderBlocked*/
+
+/*
+ * Microseconds left before the select of proc times out, 0 once it has.
+ * Elapsed time is compared rather than a start + timeout deadline,
+ * which could overflow.
+ */
+static unsigned int selectTimeLeft(mbox_proc_ptr proc, int now)
+{
+   unsigned int elapsed = now - proc->selectStart;
+
+   if (elapsed >= (unsigned int)proc->selectTimeout)
+   {
+      return 0;
+   }
+   return proc->selectTimeout - elapsed;
+} /*selectTimeLeft*/
+
+/*
+ * Puts proc on the timed selector list in deadline order. The time left
+ * shrinks by the same amount for every proc on the list, so comparing
+ * it keeps the order. The search starts at the tail, where a new
+ * timeout most often belongs.
+ */
+static void addTimedSelector(mbox_proc_ptr proc)
+{
+   int now = sys_clock();
+   unsigned int left = selectTimeLeft(proc, now);
+   mbox_proc_ptr before = lastTimedSelector;
+
+   while (before != NULL && selectTimeLeft(before, now) > left)
+   {
+      before = before->prevTimed;
+   }
+
+   proc->prevTimed = before;
+   proc->nextTimed = before != NULL ? before->nextTimed : timedSelectors;
+   if (proc->nextTimed != NULL)
+      proc->nextTimed->prevTimed = proc;
+   else
+      lastTimedSelector = proc;
+   if (before != NULL)
+      before->nextTimed = proc;
+   else
+      timedSelectors = proc;
+   proc->hasDeadline = 1;
+
+   clock_program(now + left); // a tickless clock only comes when asked
+} /*addTimedSelector*/
+
+/* Takes proc off the timed selector list if it is on it */
+static void removeTimedSelector(mbox_proc_ptr proc)
 {
-   mbox_proc_ptr curProc = MailBoxTable[mBoxTableSlot].blockedProc;
-   mbox_proc_ptr temp;
+   if (!proc->hasDeadline)
+   {
+      return;
+   }
+
+   if (proc->prevTimed != NULL)
+      proc->prevTimed->nextTimed = proc->nextTimed;
+   else
+      timedSelectors = proc->nextTimed;
+   if (proc->nextTimed != NULL)
+      proc->nextTimed->prevTimed = proc->prevTimed;
+   else
+      lastTimedSelector = proc->prevTimed;
+   proc->nextTimed = NULL;
+   proc->prevTimed = NULL;
+   proc->hasDeadline = 0;
+} /*removeTimedSelector*/
+
+/*
+ * Wakes every proc whose MboxSelect timeout has expired. The timed
+ * selector list is in deadline order, so only its expired head is
+ * looked at, and a tickless clock is programmed for the next one.
+ */
+void expireSelectors()
+{
+   int now = sys_clock();
+
+   while (timedSelectors != NULL && selectTimeLeft(timedSelectors, now) == 0)
+   {
+      mbox_proc_ptr proc = timedSelectors;
 
+      removeTimedSelector(proc);
+      if (proc->selectReady == 0)
+      {
+         proc->selectReady = -2;
+         unblock_proc(proc->pid);
+      }
+   }
+
+   if (timedSelectors != NULL)
+   {
+      clock_program(now + selectTimeLeft(timedSelectors, now));
+   }
+} /*expireSelectors*/
+
+/*
+ * Wakes all procs that are blocked sending to the mailbox in the given
+ * slot, marking them so their send returns -3
+ */
+void unblockBlocked(int mBoxTableSlot)
+{
    disableInterrupts();
-   while (curProc != NULL)
+   while (MailBoxTable[mBoxTableSlot].blockedProc != NULL)
    {
-      unblock_proc(curProc->pid);
-      temp = curProc;
-      curProc = curProc->next;
-      temp->next = NULL;
+      mbox_proc_ptr proc = MailBoxTable[mBoxTableSlot].blockedProc;
+
+      proc->released = 1;
+      unblock_proc(popBlocked(mBoxTableSlot));
    }
    enableInterrupts();
 } /*unblockBlocked*/
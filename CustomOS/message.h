@@ -5,6 +5,17 @@ typedef struct mail_slot mail_slot;
 typedef struct mailbox mail_box;
 typedef struct mbox_proc mbox_proc;
 typedef struct mbox_proc *mbox_proc_ptr;
+typedef struct payloadPool payloadPool;
+typedef struct selectNode selectNode;
+
+#define MAX_SELECT 16     // most mailboxes one MboxSelect can wait on
+#define HANDOFF_REFUSED -2 // mbox_proc msg_size when a handed off msg didn't fit
+
+/* Message payload size classes. Zero byte messages take no payload. */
+#define NUM_SIZE_CLASSES 3
+#define SMALL_MSG_SIZE 8
+#define MEDIUM_MSG_SIZE 32
+#define HEAP_SIZE_CLASS NUM_SIZE_CLASSES // payload malloc'd because its pools ran dry
 
 struct mailbox
 {
@@ -17,8 +28,14 @@ struct mailbox
    int numBlocked;
    int isReleased;
    slot_ptr first_slot;       // First slot of the mailbox, head of a linked list
+   slot_ptr last_slot;        // tail of the slot list
    mbox_proc_ptr waitingProc; // a process that is waiting to recieve a message
+   mbox_proc_ptr lastWaiting; // tail of the waiting list
    mbox_proc_ptr blockedProc;
+   mbox_proc_ptr lastBlocked; // tail of the blocked list
+   selectNode *selectors;     // procs waiting on this box in MboxSelect, oldest first
+   selectNode *lastSelector;  // tail of the selector list
+   int numSelectors;
 };
 
 struct mail_slot
@@ -28,7 +45,9 @@ struct mail_slot
    /* other items as needed... */
    int index; // The index of this slot within the table
    int messageSize;
-   char message[MAX_MESSAGE];
+   int isRef;     // 1 if the message was sent by reference
+   int sizeClass; // payload pool the message came from, -1 if none
+   char *message; // pool buffer, or the sender's buffer when isRef is set
    slot_ptr next_in_box;
    slot_ptr prev_in_box;
    mbox_proc_ptr associatedProcs;
@@ -39,6 +58,21 @@ struct mbox_proc
    int pid;
    int status; // 0 for Ready 1 for Waiting 2 for Blocked
    int index;  // Slot within the proc table
+   void *msg_buf; // receive buffer, used for direct handoff while waiting
+   int buf_size;  // size of msg_buf
+   int wantsRef;  // 1 if waiting in MboxReceiveRef
+   int msg_size;  // size of a message handed off directly, -1 if none
+   int released;  // 1 if woken because the box it waited on was released
+
+   /* MboxSelect state */
+   int numSelecting;   // number of boxes being selected on, 0 if none
+   int selectReady;    // id of the box that woke us, or -2 timeout, -3 released
+   int hasDeadline;    // 1 while on the timed selector list
+   int selectStart;    // sys_clock() when the select blocked
+   int selectTimeout;  // microseconds after selectStart it times out
+   selectNode *selectNodes;
+   mbox_proc_ptr nextTimed; // timed selector list, soonest deadline first
+   mbox_proc_ptr prevTimed;
    mbox_proc_ptr next;
    mbox_proc_ptr prev;
 };
@@ -57,3 +91,22 @@ union psr_values
    struct psr_bits bits;
    unsigned int integer_part;
 };
+
+/* A pool of fixed size message payload buffers */
+struct payloadPool
+{
+   int bufSize;     // bytes per buffer
+   int numBufs;     // number of buffers in the pool
+   char *buffers;   // numBufs * bufSize bytes
+   int *freeStack;  // indices of free buffers
+   int freeTop;
+};
+
+/* Links a selecting proc into the selector list of one mailbox */
+struct selectNode
+{
+   mbox_proc_ptr proc;
+   int boxSlot; // the mailbox's slot in the table, -1 once released
+   selectNode *next;
+   selectNode *prev;
+};
@@ -9,8 +9,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <processManager.h>
+#include "stats.h"
 #include "kernel.h"
+#include "trace.h"
 
 /* ------------------------- Prototypes ----------------------------------- */
 int sentinel(char *);
@@ -23,17 +27,37 @@ static void check_deadlock();
 void clock_interrupt(int, void *);
 int assign_pid();
 int get_pid();
+int getpid();
 void dump_processes();
 int block_me(int);
 int unblock_proc(int);
 int zap(int);
 int is_zapped();
 void addToReadyList(int);
-void frontToBack(procLinkedList);
+void frontToBack(procLinkedList *);
 void removeFromReadyList(int, int);
 void addToBlockedList(int);
 int removeFromBlockedList(int);
-void removeFromChildList(int);
+static void appendToList(procLinkedList *, proc_ptr);
+static void unlinkFromList(procLinkedList *, proc_ptr);
+void removeFromChildList(proc_ptr);
+static void changePriority(proc_ptr, int);
+static int sliceLength(void);
+static void armClock(void);
+void check_preempt(void);
+void hold_dispatch(void);
+void release_dispatch(void);
+static void initStackPools(void);
+static int stackClass(int);
+static void *allocStack(int);
+static void freeStack(void *, int);
+static void *newStack(int);
+static void deleteStack(void *, int);
+static void accountSwitch(proc_ptr, proc_ptr, unsigned int);
+static void accountWake(proc_ptr, unsigned int);
+int readtime(void);
+void trace_record(int, int, int);
+int trace_dump(char *);
 
 /* -------------------------- Globals ------------------------------------- */
 
@@ -47,6 +71,19 @@ proc_struct ProcTable[MAXPROC];
 procLinkedList ReadyProcs[SENTINELPRIORITY + 1]; // Each slot represents a priority, slot 0 is not occupied
 procLinkedList BlockedProcs;
 
+/* Bit i is set iff ReadyProcs[i] is non-empty */
+unsigned int ReadyBitmap = 0;
+
+/* Scheduling policy, SCHED_FIXED or SCHED_MLFQ, chosen before startup */
+int schedPolicy = SCHED_FIXED;
+
+/* MLFQ time quantum for each priority level in microseconds. Higher
+ * priority levels get shorter slices. */
+int mlfqQuantum[SENTINELPRIORITY + 1] = {0, 20000, 40000, 80000, 160000, 320000, 320000};
+
+/* Pools of free process stacks, one per size class */
+stackPool StackPools[NUM_STACK_CLASSES];
+
 /* current process ID */
 proc_ptr Current;
 
@@ -56,6 +93,21 @@ unsigned int next_pid = SENTINELPID;
 /* The number of processes currently in the process table*/
 int numProcs = 0;
 
+/* While > 0, fork1 leaves new procs on the ready list without dispatching */
+int dispatchHolds = 0;
+
+/* 1 if a time slice ran out during a hold, release_dispatch finishes it */
+int slicePending = 0;
+
+/* 1 for a tickless clock: rather than ticking, it is programmed for the
+ * next event any phase needs, set before startup */
+int tickless = 1;
+
+/* Kernel trace ring buffer shared by every phase, see trace.h */
+int traceEnabled = 1;
+static traceRecord TraceRing[TRACE_RECORDS];
+static unsigned int traceHead = 0; // # of records ever written
+
 /* -------------------------- Functions ----------------------------------- */
 /* ------------------------------------------------------------------------
    Name - startup
@@ -75,12 +127,17 @@ void startup()
    /* initialize the process table and ready list */
    memset(ProcTable, 0, MAXPROC * sizeof(ProcTable[0]));
    memset(ReadyProcs, 0, (SENTINELPRIORITY + 1) * sizeof(ReadyProcs[0]));
+   memset(&BlockedProcs, 0, sizeof(BlockedProcs));
+   ReadyBitmap = 0;
 
    if (DEBUG && debugflag)
       console("startup(): initializing the Ready & Blocked lists\n");
 
+   initStackPools();
+
    /* Initialize the clock interrupt handler */
    int_vec[CLOCK_DEV] = clock_interrupt;
+   clock_tickless(tickless);
 
    /* startup a sentinel process */
    if (DEBUG && debugflag)
@@ -125,8 +182,15 @@ void startup()
    ----------------------------------------------------------------------- */
 void finish()
 {
+   char *tracePath = getenv("USLOSS_TRACE");
+
    if (DEBUG && debugflag)
       console("in finish...\n");
+
+   if (tracePath != NULL && trace_dump(tracePath) == -1)
+   {
+      console("finish(): could not write trace to %s\n", tracePath);
+   }
 } /* finish */
 
 /* ------------------------------------------------------------------------
@@ -191,41 +255,53 @@ int fork1(char *name, int (*f)(char *), char *arg, int stacksize, int priority)
    /* Initialize context for this process, but use launch function pointer for
     * the initial value of the process's program counter (PC)
     */
-   ProcTable[proc_slot].stack = malloc(stacksize);
+   int classIndex = stackClass(stacksize);
+   if (classIndex != -1)
+   {
+      stacksize = StackPools[classIndex].stackSize; // round up to the class size
+   }
+   ProcTable[proc_slot].stack = allocStack(stacksize);
    ProcTable[proc_slot].stacksize = stacksize;
    context_init(&(ProcTable[proc_slot].state), psr_get(),
                 ProcTable[proc_slot].stack,
                 ProcTable[proc_slot].stacksize, launch);
 
    ProcTable[proc_slot].priority = priority;
+   ProcTable[proc_slot].base_priority = priority;
    ProcTable[proc_slot].slot = proc_slot;
 
    // Add this newly created process as the child of Current
-   if ((Current != NULL) && (Current->child_proc_ptr == NULL))
+   if (Current != NULL)
    {
       ProcTable[proc_slot].parent_pid = Current->pid;
+
+      // push onto the front of the child list
+      ProcTable[proc_slot].next_sibling_ptr = Current->child_proc_ptr;
+      if (Current->child_proc_ptr != NULL)
+      {
+         Current->child_proc_ptr->prev_sibling_ptr = &ProcTable[proc_slot];
+      }
       Current->child_proc_ptr = &ProcTable[proc_slot];
       Current->num_children++;
    }
-   else if (Current != NULL)
-   {
-      ProcTable[proc_slot].parent_pid = Current->pid;
-      Current->child_proc_ptr->next_sibling_ptr = &ProcTable[proc_slot];
-      Current->num_children++;
-   }
    else
    {
       Current = &ProcTable[proc_slot];
    }
 
    ProcTable[proc_slot].status = 1; // Set the process as ready (status 1)
+   ProcTable[proc_slot].state_since = sys_clock();
    addToReadyList(proc_slot);
 
    p1_fork(ProcTable[proc_slot].pid);
+   TRACE(TRACE_FORK, ProcTable[proc_slot].pid, priority);
 
    numProcs++;
 
-   dispatcher();
+   if (dispatchHolds == 0)
+   {
+      dispatcher();
+   }
 
    return ProcTable[proc_slot].pid;
 
@@ -280,37 +356,45 @@ int join(int *code)
       return -2;
    }
 
-   proc_ptr cur = Current->child_proc_ptr;
+   proc_ptr child;
    int quit_pid;
 
-   Current->status = 9;
-   removeFromReadyList(Current->priority, Current->pid);
-   addToBlockedList(Current->slot);
-   dispatcher();
-
-   while (1)
+   // block until quit puts one of our children on the quit queue
+   while (Current->quit_head == NULL)
    {
-      if (cur->status == 4)
-      {
-         *code = cur->status_to_parent;
-         quit_pid = cur->pid;
-
-         // reset the procs slot
-         removeFromChildList(cur->pid);
-         memset(&ProcTable[cur->slot], 0, sizeof(ProcTable[0]));
-         Current->num_children--;
-         numProcs--;
-         return quit_pid;
-      }
-      else if (cur->next_sibling_ptr == NULL)
-      {
-         cur = Current->child_proc_ptr;
-      }
-      else
+      Current->status = 9;
+      Current->state_since = sys_clock();
+      removeFromReadyList(Current->priority, Current->pid);
+      addToBlockedList(Current->slot);
+      dispatcher();
+      disableInterrupts();
+
+      if (Current->quit_head == NULL && is_zapped())
       {
-         cur = cur->next_sibling_ptr;
+         return -1;
       }
    }
+
+   child = Current->quit_head;
+   Current->quit_head = child->next_quit;
+   if (Current->quit_head == NULL)
+   {
+      Current->quit_tail = NULL;
+   }
+
+   *code = child->status_to_parent;
+   quit_pid = child->pid;
+
+   // reset the procs slot, its stack goes back to the pool
+   removeFromChildList(child);
+   freeStack(child->stack, child->stacksize);
+   memset(&ProcTable[child->slot], 0, sizeof(ProcTable[0]));
+   Current->num_children--;
+   numProcs--;
+   TRACE(TRACE_JOIN, quit_pid, *code);
+
+   enableInterrupts();
+   return quit_pid;
 } /* join */
 
 /* ------------------------------------------------------------------------
@@ -335,11 +419,41 @@ void quit(int code)
    Current->status = 4; // 4 is the status number for a quit process
    Current->status_to_parent = code;
 
-   removeFromBlockedList(Current->parent_pid);    // wake the parent for join
-   addToReadyList(Current->parent_pid % MAXPROC); // the parents slot
+   proc_ptr parent = &ProcTable[Current->parent_pid % MAXPROC];
+
+   if (parent->pid == Current->parent_pid)
+   {
+      // queue ourselves for the parent's join
+      Current->next_quit = NULL;
+      if (parent->quit_tail == NULL)
+         parent->quit_head = Current;
+      else
+         parent->quit_tail->next_quit = Current;
+      parent->quit_tail = Current;
+
+      // only wake the parent if it is blocked in join
+      if (parent->status == 9)
+      {
+         accountWake(parent, sys_clock());
+         removeFromBlockedList(parent->pid);
+         addToReadyList(parent->slot);
+      }
+   }
    removeFromReadyList(Current->priority, Current->pid);
 
+   // anyone blocked in zap on us can go on now
+   while (Current->zapper_head != NULL)
+   {
+      proc_ptr zapper = Current->zapper_head;
+      Current->zapper_head = zapper->next_zapper;
+      zapper->next_zapper = NULL;
+      accountWake(zapper, sys_clock());
+      removeFromBlockedList(zapper->pid);
+      addToReadyList(zapper->slot);
+   }
+
    p1_quit(Current->pid);
+   TRACE(TRACE_QUIT, code, Current->parent_pid);
 
    dispatcher();
 } /* quit */
@@ -352,7 +466,9 @@ void quit(int code)
              swapped in.
    Parameters - none
    Returns - nothing
-   Side Effects - the context of the machine is changed
+   Side Effects - the context of the machine is changed. If nothing is
+                  ready, not even the sentinel, the proc that just blocked
+                  waits here for an interrupt to ready something.
    ----------------------------------------------------------------------- */
 void dispatcher(void)
 {
@@ -360,22 +476,32 @@ void dispatcher(void)
    proc_ptr next_process;
    proc_ptr old_process;
 
-   for (int i = 1; i < SENTINELPRIORITY + 1; i++)
+   while (ReadyBitmap == 0)
    {
+      enableInterrupts();
+      waitint();
+      disableInterrupts();
+   }
 
-      if (ReadyProcs[i].hasProc)
-      {
-         next_process = ReadyProcs[i].head;
-         old_process = Current;
-         old_process->total_cpu_time += (sys_clock() - read_cur_start_time());
-         Current = next_process;
-         Current->cur_start_time = sys_clock();
-         p1_switch(old_process->pid, next_process->pid);
-         enableInterrupts();
-         context_switch(&(old_process->state), &(next_process->state));
-         break;
-      }
+   // the lowest set bit is the highest priority with a ready proc
+   next_process = ReadyProcs[__builtin_ctz(ReadyBitmap)].head;
+   old_process = Current;
+   unsigned int now = sys_clock();
+   old_process->stats.run_time += (unsigned int)(now - read_cur_start_time());
+   if (old_process != next_process)
+   {
+      accountSwitch(old_process, next_process, now);
    }
+   Current = next_process;
+   Current->cur_start_time = now;
+   p1_switch(old_process->pid, next_process->pid);
+   if (old_process != next_process)
+   {
+      TRACE(TRACE_SWITCH, old_process->pid, next_process->pid);
+   }
+   armClock();
+   enableInterrupts();
+   context_switch(&(old_process->state), &(next_process->state));
 
 } /* dispatcher */
 
@@ -449,7 +575,64 @@ void enableInterrupts()
 
 void clock_interrupt(int interrupt_num, void *unit_num)
 {
+   // the tick can arrive while Current is blocked and the system idles,
+   // only a running proc has a slice to check
+   if (Current->status != 1)
+   {
+      return;
+   }
+
+   // a higher priority proc readied since the last tick, like a driver
+   // an interrupt woke, runs now rather than when the slice ends
+   if (__builtin_ctz(ReadyBitmap) < Current->priority && dispatchHolds == 0)
+   {
+      dispatcher();
+      return;
+   }
+
+   // nothing to rotate to if Current is alone at its priority, under
+   // MLFQ it may still have to be demoted
+   if (schedPolicy == SCHED_FIXED &&
+       ReadyProcs[Current->priority].head == ReadyProcs[Current->priority].tail)
+   {
+      return;
+   }
+
    time_slice();
+   armClock(); // the slice may not be over, this interrupt came early
+}
+
+/*
+ * Programs the tickless clock for the end of Current's slice if it
+ * shares its priority or may be demoted. Preempting Current for a proc
+ * of higher priority is left to check_preempt.
+ */
+static void armClock()
+{
+   if (!tickless || Current == NULL || Current->status != 1 || slicePending)
+   {
+      return;
+   }
+
+   if ((schedPolicy == SCHED_MLFQ && Current->priority < MINPRIORITY) ||
+       ReadyProcs[Current->priority].head != ReadyProcs[Current->priority].tail)
+   {
+      clock_program(read_cur_start_time() + sliceLength());
+   }
+}
+
+/*
+ * Called by the interrupt and syscall handlers of the phases above as
+ * they finish. With a tickless clock no tick comes along to run a proc
+ * they readied ahead of Current, so it runs now.
+ */
+void check_preempt()
+{
+   if (tickless && Current->status == 1 && ReadyBitmap != 0 &&
+       __builtin_ctz(ReadyBitmap) < Current->priority && dispatchHolds == 0)
+   {
+      dispatcher();
+   }
 }
 
 /* ------------------------------------------------------------------------
@@ -479,6 +662,12 @@ int get_pid()
    return Current->pid;
 }
 
+/* Same as get_pid, under the name the phases above call it by */
+int getpid()
+{
+   return Current->pid;
+}
+
 void dump_processes()
 {
    for (int i = 0; i < MAXPROC; i++)
@@ -491,7 +680,7 @@ void dump_processes()
          console("PROC PRIORITY %d \n", ProcTable[i].priority);
          console("PROC STATUS: %d \n", ProcTable[i].status);
          console("PROC NUM CHILDREN: %d \n", ProcTable[i].num_children);
-         console("PROC TOTAL CPU TIME: %d \n", ProcTable[i].total_cpu_time);
+         console("PROC TOTAL CPU TIME: %llu \n", ProcTable[i].stats.run_time);
          console("--------------------------------------- \n");
       }
    }
@@ -502,29 +691,75 @@ int read_cur_start_time()
    return Current->cur_start_time;
 }
 
+/*
+ * Returns the CPU time used by the current process in milliseconds,
+ * including the slice it is running now.
+ */
+int readtime()
+{
+   unsigned int slice = sys_clock() - read_cur_start_time();
+
+   return (Current->stats.run_time + slice) / 1000;
+}
+
+/* Microseconds Current may run before time_slice rotates it */
+static int sliceLength()
+{
+   if (schedPolicy == SCHED_MLFQ)
+   {
+      return mlfqQuantum[Current->priority];
+   }
+   return FIXED_QUANTUM;
+}
+
 void time_slice()
 {
    int startTime = read_cur_start_time();
+   int quantum = sliceLength();
 
-   // 80,000 microseconds = 80ms
-   if (sys_clock() - startTime >= 80000)
+   if (sys_clock() - startTime >= quantum)
    {
-      // Remove process from front of queue, put on back
-      frontToBack(ReadyProcs[Current->priority]);
+      // don't switch in the middle of a held batch
+      if (dispatchHolds > 0)
+      {
+         slicePending = 1;
+         return;
+      }
+
+      if (schedPolicy == SCHED_MLFQ && Current->priority < MINPRIORITY)
+      {
+         // burned its whole slice, demote it one level
+         changePriority(Current, Current->priority + 1);
+      }
+      else
+      {
+         // Remove process from front of queue, put on back
+         frontToBack(&ReadyProcs[Current->priority]);
+      }
       dispatcher();
    }
 }
 
+/* Moves a ready proc to the back of the ready list of a new priority */
+static void changePriority(proc_ptr theProc, int newPriority)
+{
+   removeFromReadyList(theProc->priority, theProc->pid);
+   theProc->priority = newPriority;
+   addToReadyList(theProc->slot);
+}
+
 int block_me(int new_status)
 {
 
-   if (new_status >= 10)
+   if (new_status <= 10)
    {
-      console("ERROR: NEW STATUS MUST BE >= 10 \n");
+      console("ERROR: NEW STATUS MUST BE > 10 \n");
       halt(1);
    }
 
    Current->status = new_status;
+   Current->state_since = sys_clock();
+   TRACE(TRACE_BLOCK, new_status, 0);
    removeFromReadyList(Current->priority, Current->pid);
    addToBlockedList(Current->slot);
    dispatcher();
@@ -542,24 +777,112 @@ int unblock_proc(int pid)
    }
    proc_struct theProc = ProcTable[slot];
 
-   if (theProc.status <= 10 || theProc.pid == Current->pid)
+   // Current can be the one blocked when an interrupt comes in while the
+   // dispatcher idles, so only its status is checked
+   if (theProc.status <= 10)
    {
       return -2;
    }
 
-   if (theProc.status == 3)
+   accountWake(&ProcTable[slot], sys_clock());
+   removeFromBlockedList(pid);
+   TRACE(TRACE_UNBLOCK, pid, 0);
+
+   // under MLFQ a proc that blocked (mailbox, semaphore, disk) is boosted
+   if (schedPolicy == SCHED_MLFQ && ProcTable[slot].priority > ProcTable[slot].base_priority)
    {
-      return -1;
+      ProcTable[slot].priority--;
    }
 
-   removeFromBlockedList(pid);
    addToReadyList(slot);
+   armClock(); // Current may have to share its slice now
    return 0;
 }
 
+/* ------------------------------------------------------------------------
+   Name - zap
+   Purpose - Marks a process as zapped, so it knows to quit, and waits
+             for it to do so.
+   Parameters - the pid of the process to zap
+   Returns - 0 once the process has quit, -1 if the caller was itself
+             zapped while waiting
+   Side Effects - halts if the process zaps itself or doesn't exist. The
+                  caller is blocked until the process quits. A process
+                  blocked in block_me is woken so it can see the zap.
+   ----------------------------------------------------------------------- */
+int zap(int pid)
+{
+   disableInterrupts();
+   proc_ptr target = &ProcTable[pid % MAXPROC];
+
+   if (pid == Current->pid)
+   {
+      console("zap(): process %d tried to zap itself.  Halting...\n", pid);
+      halt(1);
+   }
+
+   if (target->pid != pid)
+   {
+      console("zap(): process %d does not exist.  Halting...\n", pid);
+      halt(1);
+   }
+
+   target->zapped = 1;
+   if (target->status > 10)
+   {
+      unblock_proc(pid);
+   }
+
+   // the slot stays the target's until its parent joins it
+   while (target->pid == pid && target->status != 4)
+   {
+      Current->next_zapper = target->zapper_head;
+      target->zapper_head = Current;
+      Current->status = 10;
+      Current->state_since = sys_clock();
+      removeFromReadyList(Current->priority, Current->pid);
+      addToBlockedList(Current->slot);
+      dispatcher();
+      disableInterrupts();
+   }
+
+   enableInterrupts();
+   return is_zapped() ? -1 : 0;
+} /* zap */
+
+/*
+ * Stops fork1 from dispatching, so a batch of procs can be created
+ * and enqueued before any of them runs. Calls nest.
+ */
+void hold_dispatch()
+{
+   dispatchHolds++;
+}
+
+/*
+ * Undoes one hold_dispatch. The last release dispatches once for the
+ * whole batch, rotating Current out first if its slice ran out while
+ * dispatching was held.
+ */
+void release_dispatch()
+{
+   if (dispatchHolds > 0 && --dispatchHolds == 0)
+   {
+      if (slicePending)
+      {
+         slicePending = 0;
+         time_slice();
+      }
+      else
+      {
+         dispatcher();
+      }
+   }
+}
+
 int is_zapped()
 {
-   if (Current->status == 3)
+   if (Current->zapped)
    {
       return 1;
    }
@@ -574,156 +897,370 @@ void addToReadyList(int slot)
 {
    int priority = ProcTable[slot].priority;
 
-   if (ReadyProcs[priority].hasProc)
+   // a proc can only be on one list at a time
+   if (ProcTable[slot].cur_list == &ReadyProcs[priority])
    {
-      // Add this to the end of the ready list with the correct priority
-      ReadyProcs[priority].tail->next_in_list = &ProcTable[slot];
-      // Added proc becomes the new tail
-      ReadyProcs[priority].tail = &ProcTable[slot];
-   }
-   else
-   {
-      ReadyProcs[priority].hasProc = 1;
-      ReadyProcs[priority].head = &ProcTable[slot];
-      ReadyProcs[priority].tail = &ProcTable[slot];
+      return;
    }
+
+   appendToList(&ReadyProcs[priority], &ProcTable[slot]);
+   ReadyBitmap |= (1u << priority);
 }
 
 /* Moves item from from of linked list to back*/
-void frontToBack(procLinkedList theList)
+void frontToBack(procLinkedList *theList)
 {
    // if the list is a single element, no need to do anything
-   if (theList.head != theList.tail)
+   if (theList->head != theList->tail)
    {
-      theList.tail->next_in_list = theList.head;
-      theList.tail = theList.head;
-      theList.head = theList.head->next_in_list;
-      theList.tail->next_in_list = NULL;
+      proc_ptr oldHead = theList->head;
+      unlinkFromList(theList, oldHead);
+      appendToList(theList, oldHead);
    }
 }
 
 void removeFromReadyList(int priority, int pidToRemove)
 {
-   proc_ptr cur = ReadyProcs[priority].head;
-   proc_ptr temp;
+   proc_ptr theProc = &ProcTable[pidToRemove % MAXPROC];
+
+   if (theProc->pid != pidToRemove)
+   {
+      return;
+   }
+
+   unlinkFromList(&ReadyProcs[priority], theProc);
+
+   if (!ReadyProcs[priority].hasProc)
+   {
+      ReadyBitmap &= ~(1u << priority);
+   }
+}
+
+void addToBlockedList(int slot)
+{
+   if (ProcTable[slot].cur_list == &BlockedProcs)
+   {
+      return;
+   }
+
+   appendToList(&BlockedProcs, &ProcTable[slot]);
+}
+
+int removeFromBlockedList(int pidToRemove)
+{
+   proc_ptr theProc = &ProcTable[pidToRemove % MAXPROC];
+
+   if (theProc->pid != pidToRemove || theProc->cur_list != &BlockedProcs)
+   {
+      return -1;
+   }
+
+   theProc->status = 1;
+   unlinkFromList(&BlockedProcs, theProc);
+   return 0;
+}
+
+/* Adds a proc to the tail of the given list */
+static void appendToList(procLinkedList *theList, proc_ptr theProc)
+{
+   theProc->next_in_list = NULL;
+   theProc->prev_in_list = theList->tail;
+   theProc->cur_list = theList;
 
-   if (cur->pid == pidToRemove && cur->next_in_list == NULL)
+   if (theList->hasProc)
+   {
+      theList->tail->next_in_list = theProc;
+   }
+   else
    {
-      ReadyProcs[priority].head = NULL;
-      ReadyProcs[priority].tail = NULL;
-      ReadyProcs[priority].hasProc = 0;
+      theList->hasProc = 1;
+      theList->head = theProc;
    }
-   else if (cur->pid == pidToRemove)
+   theList->tail = theProc;
+}
+
+/* Unlinks a proc from the given list in constant time. Does nothing if
+ * the proc is not on that list. */
+static void unlinkFromList(procLinkedList *theList, proc_ptr theProc)
+{
+   if (theProc->cur_list != theList)
+   {
+      return;
+   }
+
+   if (theProc->prev_in_list != NULL)
+      theProc->prev_in_list->next_in_list = theProc->next_in_list;
+   else
+      theList->head = theProc->next_in_list;
+
+   if (theProc->next_in_list != NULL)
+      theProc->next_in_list->prev_in_list = theProc->prev_in_list;
+   else
+      theList->tail = theProc->prev_in_list;
+
+   theProc->next_in_list = NULL;
+   theProc->prev_in_list = NULL;
+   theProc->cur_list = NULL;
+
+   if (theList->head == NULL)
    {
-      ReadyProcs[priority].head = cur->next_in_list;
-      cur->next_in_list = NULL;
+      theList->hasProc = 0;
    }
+}
+
+/* Unlinks a child of Current from its child list */
+void removeFromChildList(proc_ptr child)
+{
+   if (child->prev_sibling_ptr != NULL)
+      child->prev_sibling_ptr->next_sibling_ptr = child->next_sibling_ptr;
    else
+      Current->child_proc_ptr = child->next_sibling_ptr;
+
+   if (child->next_sibling_ptr != NULL)
+      child->next_sibling_ptr->prev_sibling_ptr = child->prev_sibling_ptr;
+
+   child->next_sibling_ptr = NULL;
+   child->prev_sibling_ptr = NULL;
+}
+
+/* Fills each stack pool with STACKS_PER_CLASS stacks of its size */
+static void initStackPools()
+{
+   for (int c = 0; c < NUM_STACK_CLASSES; c++)
    {
-      while (cur->next_in_list != NULL)
+      StackPools[c].stackSize = USLOSS_MIN_STACK << c;
+      StackPools[c].numFree = 0;
+
+      for (int i = 0; i < STACKS_PER_CLASS; i++)
       {
-         if (cur->next_in_list->pid == pidToRemove)
-         {
-            temp = cur->next_in_list;
-            cur->next_in_list = temp->next_in_list;
-            temp->next_in_list = NULL;
-         }
-         cur = cur->next_in_list;
+         StackPools[c].freeStacks[StackPools[c].numFree++] = newStack(StackPools[c].stackSize);
       }
    }
 }
 
-void addToBlockedList(int slot)
+/* Returns the smallest stack class that fits stacksize, -1 if none does */
+static int stackClass(int stacksize)
+{
+   for (int c = 0; c < NUM_STACK_CLASSES; c++)
+   {
+      if (stacksize <= StackPools[c].stackSize)
+      {
+         return c;
+      }
+   }
+   return -1;
+}
+
+/* Takes a stack from the pool for its class, making one if the pool is
+ * empty. Sizes bigger than every class are allocated on their own. */
+static void *allocStack(int stacksize)
+{
+   int c = stackClass(stacksize);
+
+   if (c != -1 && StackPools[c].numFree > 0)
+   {
+      return StackPools[c].freeStacks[--StackPools[c].numFree];
+   }
+
+   return newStack(stacksize);
+}
+
+/* Gives a reaped proc's stack back to its pool */
+static void freeStack(void *stack, int stacksize)
 {
+   int c = stackClass(stacksize);
 
-   if (BlockedProcs.hasProc)
+   if (stack == NULL)
    {
-      // Add this to the end of the ready list with the correct priority
-      BlockedProcs.tail->next_in_list = &ProcTable[slot];
-      // Added proc becomes the new tail
-      BlockedProcs.tail = &ProcTable[slot];
+      return;
+   }
+
+   if (c != -1 && StackPools[c].stackSize == stacksize && StackPools[c].numFree < MAXPROC)
+   {
+      StackPools[c].freeStacks[StackPools[c].numFree++] = stack;
    }
    else
    {
-      BlockedProcs.hasProc = 1;
-      BlockedProcs.head = &ProcTable[slot];
-      BlockedProcs.tail = &ProcTable[slot];
+      deleteStack(stack, stacksize);
    }
 }
 
-int removeFromBlockedList(int pidToRemove)
+/* Allocates a new stack, below a guard page if STACK_GUARD is set */
+static void *newStack(int stacksize)
 {
-   proc_ptr cur = BlockedProcs.head;
-   proc_ptr temp;
+   if (!STACK_GUARD)
+   {
+      return malloc(stacksize);
+   }
 
-   if (cur == NULL)
+   long pageSize = sysconf(_SC_PAGESIZE);
+   char *base = mmap(NULL, stacksize + pageSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (base == MAP_FAILED)
    {
-      return -1;
+      console("newStack(): out of memory for process stacks.  Halting...\n");
+      halt(1);
    }
 
-   if (cur->pid == pidToRemove && cur->next_in_list == NULL)
+   // stacks grow down, so an overflow runs into the page below
+   mprotect(base, pageSize, PROT_NONE);
+   return base + pageSize;
+}
+
+/* Releases a stack made by newStack */
+static void deleteStack(void *stack, int stacksize)
+{
+   if (!STACK_GUARD)
    {
-      cur->status = 1;
-      BlockedProcs.head = NULL;
-      BlockedProcs.tail = NULL;
-      BlockedProcs.hasProc = 0;
-      return 0;
+      free(stack);
+      return;
    }
-   else if (cur->pid == pidToRemove)
+
+   long pageSize = sysconf(_SC_PAGESIZE);
+   munmap((char *)stack - pageSize, stacksize + pageSize);
+}
+
+/*
+ * Charges a context switch from old to next at time now: old is either
+ * preempted while still ready or gave up the CPU itself, and next stops
+ * waiting for the CPU.
+ */
+static void accountSwitch(proc_ptr old, proc_ptr next, unsigned int now)
+{
+   if (old->status == 1)
    {
-      cur->status = 1;
-      BlockedProcs.head = cur->next_in_list;
-      cur->next_in_list = NULL;
-      return 0;
+      old->stats.involuntary_switches++;
+      old->state_since = now;
    }
    else
    {
-      while (cur->next_in_list != NULL)
-      {
-         if (cur->next_in_list->pid == pidToRemove)
-         {
-            cur->next_in_list->status = 1;
-            temp = cur->next_in_list;
-            cur->next_in_list = temp->next_in_list;
-            temp->next_in_list = NULL;
-         }
-         cur = cur->next_in_list;
-      }
-      return 0;
+      old->stats.voluntary_switches++;
    }
 
-   return -1;
+   next->stats.ready_time += now - next->state_since;
+}
+
+/*
+ * Charges the time a blocked proc spent blocked to the bucket for what
+ * it was blocked on. The proc counts as ready from now on.
+ */
+static void accountWake(proc_ptr theProc, unsigned int now)
+{
+   unsigned int blocked = now - theProc->state_since;
+
+   if (theProc->disk_wait)
+      theProc->stats.disk_time += blocked;
+   else if (theProc->status == 9)
+      theProc->stats.join_time += blocked;
+   else if (theProc->status == MBOX_BLOCKED || theProc->status == SELECT_BLOCKED)
+      theProc->stats.mbox_time += blocked;
+   else if (theProc->status == SEM_BLOCKED)
+      theProc->stats.sem_time += blocked;
+   else
+      theProc->stats.other_time += blocked;
+
+   theProc->state_since = now;
 }
 
-void removeFromChildList(int pidToRemove)
+/*
+ * Copies the accounting of the proc with the given pid into stats. The
+ * slice the current proc is running is included. Returns 0, or -1 if
+ * there is no such proc.
+ */
+int get_proc_stats(int pid, procStats *stats)
 {
-   proc_ptr cur = Current->child_proc_ptr;
-   proc_ptr temp;
+   proc_ptr theProc = &ProcTable[pid % MAXPROC];
 
-   if (cur == NULL)
+   if (pid <= 0 || theProc->pid != pid || stats == NULL)
    {
-      return;
+      return -1;
    }
 
-   if (cur->pid == pidToRemove && cur->next_sibling_ptr == NULL)
+   disableInterrupts();
+   *stats = theProc->stats;
+   if (theProc == Current)
    {
-      Current->child_proc_ptr = NULL;
+      stats->run_time += (unsigned int)(sys_clock() - read_cur_start_time());
    }
-   else if (cur->pid == pidToRemove)
+   enableInterrupts();
+
+   return 0;
+}
+
+/*
+ * Counts a message of the given size sent (sent is 1) or received
+ * (sent is 0) by the current proc.
+ */
+void add_msg_stats(int sent, int bytes)
+{
+   if (sent)
    {
-      Current->child_proc_ptr = cur->next_sibling_ptr;
+      Current->stats.msgs_sent++;
+      Current->stats.bytes_sent += bytes;
    }
    else
    {
-      while (cur->next_sibling_ptr != NULL)
+      Current->stats.msgs_received++;
+      Current->stats.bytes_received += bytes;
+   }
+}
+
+/*
+ * Marks the current proc as waiting on a disk request (1) or not (0),
+ * so the time it spends blocked is charged to disk_time.
+ */
+void mark_disk_wait(int waiting)
+{
+   Current->disk_wait = waiting;
+}
+
+/*
+ * Records one event in the trace ring, overwriting the oldest record
+ * once the ring is full. The slot is claimed with an atomic add instead
+ * of disabling interrupts, so a handler that traces in the middle just
+ * takes the next slot.
+ */
+void trace_record(int event, int arg1, int arg2)
+{
+   unsigned int i = __atomic_fetch_add(&traceHead, 1, __ATOMIC_RELAXED);
+   traceRecord *rec = &TraceRing[i & (TRACE_RECORDS - 1)];
+
+   rec->timestamp = sys_clock();
+   rec->event = event;
+   rec->pid = Current != NULL ? Current->pid : 0;
+   rec->arg1 = arg1;
+   rec->arg2 = arg2;
+}
+
+/*
+ * Writes the trace ring, oldest record first, to the file at path.
+ * Returns 0 on success, -1 if the file could not be written.
+ */
+int trace_dump(char *path)
+{
+   FILE *out = fopen(path, "wb");
+   unsigned int head = traceHead;
+   unsigned int count = head < TRACE_RECORDS ? head : TRACE_RECORDS;
+   traceHeader header = {TRACE_MAGIC, TRACE_VERSION, sizeof(traceRecord), count, head - count};
+   int result = 0;
+
+   if (out == NULL)
+   {
+      return -1;
+   }
+
+   if (fwrite(&header, sizeof(header), 1, out) != 1)
+   {
+      result = -1;
+   }
+   for (unsigned int i = head - count; result == 0 && i != head; i++)
+   {
+      if (fwrite(&TraceRing[i & (TRACE_RECORDS - 1)], sizeof(traceRecord), 1, out) != 1)
       {
-         if (cur->next_sibling_ptr->pid == pidToRemove)
-         {
-            temp = cur->next_sibling_ptr;
-            cur->next_in_list = temp->next_in_list;
-            temp->next_in_list = NULL;
-         }
-         cur = cur->next_sibling_ptr;
+         result = -1;
       }
    }
+
+   fclose(out);
+   return result;
 }
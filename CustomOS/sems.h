@@ -1,8 +1,15 @@
 #pragma once
 
+#define MAXSEMS 200
+
+/* Syscalls added on top of the ones in usyscall.h */
+#define SYS_SPAWNMANY 31
+#define SYS_GETPROCSTATS 32
+
 typedef struct Semaphore Semaphore;
 typedef struct UserProc UserProc;
 typedef struct UserProc *user_proc_ptr;
+typedef struct SpawnManyArgs SpawnManyArgs;
 
 struct Semaphore
 {
@@ -10,18 +17,33 @@ struct Semaphore
     int id;
     int value;
     user_proc_ptr firstWaiting;
+    user_proc_ptr lastWaiting;
 };
 
 struct UserProc
 {
 
     user_proc_ptr nextChild;
+    user_proc_ptr prevChild;
 
     int pid;
     int (*entryPoint)(char *);
     int parentPid;
     int startupMbox; // the ID of the private mailbox
-    int semMbox;     // the zero slot box for sems
     user_proc_ptr firstChild;
     user_proc_ptr nextWaiting;
+    int waitingPid; // pid blocked in semP, set on every addToWaitList
+    int semFreed;   // set when semFree wakes the proc out of semP
+};
+
+/* Passed in arg1 of the SpawnMany syscall */
+struct SpawnManyArgs
+{
+    char *name;
+    int (*func)(char *);
+    char *arg;
+    int stack_size;
+    int priority;
+    int count; // number of children to spawn
+    int *pids; // filled with the pid of each child, count entries
 };
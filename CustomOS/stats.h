@@ -0,0 +1,34 @@
+#pragma once
+
+/* Per-process accounting kept by phase 1, returned by GetProcStats.
+ * All times are in microseconds. */
+typedef struct procStats procStats;
+
+/* block_me statuses of the phases above phase 1, which charges blocked
+ * time to the matching bucket below. block_me only takes statuses > 10. */
+#define MBOX_BLOCKED 11   // MboxSend or MboxReceive waiting on a mailbox
+#define SEM_BLOCKED 12    // semP waiting on a semaphore
+#define SELECT_BLOCKED 13 // MboxSelect waiting on a set of mailboxes
+
+struct procStats
+{
+   unsigned long long run_time;   // on the CPU
+   unsigned long long ready_time; // runnable, waiting for the CPU
+   unsigned long long mbox_time;  // blocked on a mailbox or in MboxSelect
+   unsigned long long sem_time;   // blocked on a semaphore
+   unsigned long long disk_time;  // blocked waiting for a disk request
+   unsigned long long join_time;  // blocked in join
+   unsigned long long other_time; // blocked for any other reason
+
+   unsigned long long voluntary_switches;   // gave up the CPU by blocking or quitting
+   unsigned long long involuntary_switches; // preempted while still ready
+
+   unsigned long long msgs_sent;
+   unsigned long long bytes_sent;
+   unsigned long long msgs_received;
+   unsigned long long bytes_received;
+};
+
+extern int get_proc_stats(int pid, procStats *stats);
+extern void add_msg_stats(int sent, int bytes);
+extern void mark_disk_wait(int waiting);
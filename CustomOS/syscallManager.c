@@ -2,18 +2,33 @@
 #include <stdio.h>
 #include <usloss.h>
 #include <usyscall.h>
+#include <libuser.h>
 #include <string.h>
+#include <processManager.h>
+#include <mailboxManager.h>
 #include "sems.h"
+#include "stats.h"
+#include "trace.h"
 
 /* ------------------------- Prototypes ----------------------------------- */
 int start3(char *);
 int spawn_real(char *name, int (*func)(char *), char *arg,
                int stack_size, int priority);
 int wait_real(int *status);
+int semcreate_real(int);
+int semp_real(int);
+static int semWait(int, int);
+int semv_real(int);
+void gettimeofday_real(int *);
+void getPID_real(int *);
 int launchUserMode(char *);
-void check_kernel_mode(void);
-void syscall_handler(int dev, void *unit);
+static void check_kernel_mode(void);
+void enableInterrupts(void);
+void disableInterrupts(void);
+static void syscall_handler(int dev, void *unit);
 void syscall_spawn(sysargs *pargs);
+void syscall_spawnMany(sysargs *pargs);
+int spawn_many_real(SpawnManyArgs *);
 void syscall_wait(sysargs *pargs);
 void syscall_terminate(sysargs *pargs);
 void syscall_semCreate(sysargs *pargs);
@@ -23,12 +38,16 @@ void syscall_semFree(sysargs *pargs);
 void syscall_getTimeofDay(sysargs *pargs);
 void syscall_cpuTime(sysargs *pargs);
 void syscall_getPID(sysargs *pargs);
+void syscall_getProcStats(sysargs *pargs);
 void addToChildList(int, int);
 void removeChild(int);
 void setToKernelMode(void);
 int assignSemID();
 int getSemSlot(int);
 void addToWaitList(int, int);
+user_proc_ptr removeFromWaitList(int);
+static int isWaiting(int, int);
+static void leaveWaitList(int, int);
 
 /* -------------------------- Globals ------------------------------------- */
 UserProc userProcTable[MAXPROC];
@@ -38,11 +57,6 @@ Semaphore semTable[MAXSEMS];
 int numSems;
 int semIDAssign = 0; // used for ID assignment
 
-int mutexBox; // Box used as a mutex for semaphores
-
-/* The syscall vector*/
-void (*sys_vec[MAXSYSCALLS])(sysargs *args);
-
 /* -------------------------- Implementation ------------------------------------- */
 int start2(char *arg)
 {
@@ -58,19 +72,16 @@ int start2(char *arg)
     {
         // create a mailbox for each user proc for synchronization
         userProcTable[i].startupMbox = MboxCreate(1, 0);
-        userProcTable[i].semMbox = MboxCreate(0, 0);
     }
 
-    memset(semTable, 0, MAXPROC * sizeof(semTable[0]));
-
-    // initialize mutex box
-    mutexBox = MboxCreate(1, 0);
+    memset(semTable, 0, MAXSEMS * sizeof(semTable[0]));
 
     /* Initialize syscall interrupt*/
     int_vec[SYSCALL_INT] = syscall_handler;
 
     /* Match syscall numbers to functions*/
     sys_vec[SYS_SPAWN] = &syscall_spawn;
+    sys_vec[SYS_SPAWNMANY] = &syscall_spawnMany;
     sys_vec[SYS_WAIT] = &syscall_wait;
     sys_vec[SYS_TERMINATE] = &syscall_terminate;
     sys_vec[SYS_SEMCREATE] = &syscall_semCreate;
@@ -80,9 +91,11 @@ int start2(char *arg)
     sys_vec[SYS_GETTIMEOFDAY] = &syscall_getTimeofDay;
     sys_vec[SYS_CPUTIME] = &syscall_cpuTime;
     sys_vec[SYS_GETPID] = &syscall_getPID;
+    sys_vec[SYS_GETPROCSTATS] = &syscall_getProcStats;
 
-    pid = spawn_real("start3", start3, NULL, 4 * USLOSS_MIN_STACK, 3);
-    pid = wait_real(&status);
+    /* start3 starts the phase 4 drivers, so it stays in kernel mode */
+    pid = fork1("start3", start3, NULL, 4 * USLOSS_MIN_STACK, 3);
+    pid = join(&status);
 
     return 0;
 
@@ -143,11 +156,37 @@ int spawn_real(char *name, int (*func)(char *), char *arg,
     return pid;
 } /* spawn_real*/
 
+/*
+ * Spawns args->count children with the same entry point, stack size
+ * and priority. Dispatching is held until all of them are on the ready
+ * list. Returns the number of children created; their pids are stored
+ * in args->pids.
+ */
+int spawn_many_real(SpawnManyArgs *args)
+{
+    int created = 0;
+
+    hold_dispatch();
+    while (created < args->count)
+    {
+        int pid = spawn_real(args->name, args->func, args->arg,
+                             args->stack_size, args->priority);
+        if (pid < 0)
+        {
+            break; // out of process slots, report what we got
+        }
+        args->pids[created++] = pid;
+    }
+    release_dispatch();
+
+    return created;
+} /* spawn_many_real*/
+
 /*
  * This function is called by the syscall_wait function.
  * it essentially causes a user proc to wait until a child
  * quits. It then returns the pid of the child that quit
- * or an error code.
+ * or an error code. Children are reaped in the order they quit.
  */
 int wait_real(int *status)
 {
@@ -187,12 +226,33 @@ void syscall_spawn(sysargs *pargs)
     pargs->arg1 = pid;
     pargs->arg4 = 0;
 
-    if (name > MAXNAME || stack_size < USLOSS_MIN_STACK || priority < 1 || priority > 6)
+    if (strlen(name) >= MAXNAME || stack_size < USLOSS_MIN_STACK || priority < 1 || priority > 6)
     {
         pargs->arg4 = 1;
     }
 } /*syscall_spawn */
 
+/*
+ * This is the function pointed to in the system call vector
+ * for the SpawnMany syscall. arg1 points to a SpawnManyArgs.
+ * The number of children created is returned in arg1.
+ */
+void syscall_spawnMany(sysargs *pargs)
+{
+    SpawnManyArgs *args = (SpawnManyArgs *)pargs->arg1;
+
+    if (args == NULL || args->count < 0 || args->pids == NULL ||
+        args->stack_size < USLOSS_MIN_STACK || args->priority < 1 || args->priority > 6)
+    {
+        pargs->arg1 = 0;
+        pargs->arg4 = -1;
+        return;
+    }
+
+    pargs->arg1 = spawn_many_real(args);
+    pargs->arg4 = 0;
+} /*syscall_spawnMany */
+
 /*
  * This is the function pointed to in the syscall vector
  * when a wait syscall is fired. The main logic for this syscall
@@ -242,6 +302,14 @@ void syscall_terminate(sysargs *pargs)
         // memset(temp, 0, sizeof(userProcTable[0]))
     }
 
+    // quit won't run while there are children left to join
+    int childPid;
+    int childStatus;
+    while ((childPid = join(&childStatus)) > 0)
+    {
+        removeChild(childPid);
+    }
+
     quit(termCode);
 
     pargs->arg1 = termCode;
@@ -255,23 +323,37 @@ void syscall_terminate(sysargs *pargs)
  */
 void syscall_semCreate(sysargs *pargs)
 {
+    int semID = semcreate_real((int)pargs->arg1);
 
-    int initialVal = (int)pargs->arg1;
-
-    // Check if slots are out or negative intial cal
-    if (numSems >= MAXSEMS || initialVal < 0)
+    if (semID < 0)
     {
         pargs->arg4 = -1;
         return;
     }
 
-    int semSlot = assignSemID();
-    semTable[semSlot].value = initialVal;
-    pargs->arg1 = semTable[semSlot].id;
+    pargs->arg1 = semID;
     pargs->arg4 = 0;
 
 } /*syscall_semCreate*/
 
+/*
+ * Creates a semaphore with the given initial value. Returns its ID,
+ * or -1 if there are no semaphore slots left or the value is negative.
+ * Also called directly by the phase 4 drivers.
+ */
+int semcreate_real(int initialVal)
+{
+    // Check if slots are out or negative intial cal
+    if (numSems >= MAXSEMS || initialVal < 0)
+    {
+        return -1;
+    }
+
+    int semSlot = assignSemID();
+    semTable[semSlot].value = initialVal;
+    return semTable[semSlot].id;
+} /*semcreate_real*/
+
 /*
  * This function is pointed to by the syscall vector.
  * It provides a p operation (decrement or block if value is 0)
@@ -279,77 +361,128 @@ void syscall_semCreate(sysargs *pargs)
  */
 void syscall_semP(sysargs *pargs)
 {
-    int semID = (int)pargs->arg1;
+    pargs->arg4 = semWait((int)pargs->arg1, 1);
+} /*syscall_semP*/
+
+/*
+ * P on the semaphore with the given ID for the phase 4 drivers. Returns
+ * 0, or -1 if there is no such semaphore or it was freed while waiting.
+ * The drivers use semaphores as
+ * locks and to wait for requests they still have queued, so a zap
+ * doesn't cut the wait short.
+ */
+int semp_real(int semID)
+{
+    return semWait(semID, 0);
+} /*semp_real*/
+
+/*
+ * Does the work of semp_real and the semP syscall. If zappable is set,
+ * a zap wakes the caller without the unit and -3 is returned. Returns 0
+ * once the unit is taken, or -1 if there is no such semaphore or semFree
+ * freed it while we waited.
+ */
+static int semWait(int semID, int zappable)
+{
     int slot = getSemSlot(semID);
+    int pid = getpid();
+    user_proc_ptr waiter = &userProcTable[pid % MAXPROC];
 
     // check for bad input
-    if (semTable[slot].status == 0 || semID < 0)
+    if (semID < 0 || semTable[slot].status == 0)
     {
-        pargs->arg4 = -1;
-        return;
+        return -1;
     }
 
-    // keep data from corruption
-    MboxSend(mutexBox, NULL, 0);
+    disableInterrupts();
 
     if (semTable[slot].value > 0)
     {
-        // decrement
-        semTable[slot].value = semTable[slot].value - 1;
+        // uncontended, just decrement
+        semTable[slot].value--;
+    }
+    else if (zappable && is_zapped())
+    {
+        enableInterrupts();
+        return -3;
     }
     else
     {
-        // get the current proc's slot
-        int procSlot = getpid() % MAXPROC;
+        // queue up and block, semV hands the unit straight to us
+        addToWaitList(slot, pid);
+        block_me(SEM_BLOCKED);
 
-        addToWaitList(slot, procSlot);
-        MboxReceive(mutexBox, NULL, 0);
+        // still queued means a zap woke us rather than a V, the drivers
+        // keep their place in the queue and wait on
+        while (!waiter->semFreed && isWaiting(slot, pid))
+        {
+            if (zappable)
+            {
+                leaveWaitList(slot, pid);
+                enableInterrupts();
+                return -3;
+            }
+            block_me(SEM_BLOCKED);
+        }
 
-        // block
-        MboxReceive(userProcTable[procSlot].semMbox, NULL, 0);
+        // the slot may already hold a new semaphore
+        if (waiter->semFreed)
+        {
+            waiter->semFreed = 0;
+            enableInterrupts();
+            return -1;
+        }
     }
+    TRACE(TRACE_SEM_P, semID, semTable[slot].value);
 
-    pargs->arg4 = 0;
-
-} /*syscall_semP*/
+    enableInterrupts();
+    return 0;
+} /*semWait*/
 
 /*
  * This function is pointed to by the syscall handler.
  * Is performs the v operation on a
- * semaphore (incrmeent and wake up waiting).
+ * semaphore (wake up the first waiting proc, or increment).
  */
 void syscall_semV(sysargs *pargs)
 {
-    int semID = (int)pargs->arg1;
+    pargs->arg4 = semv_real((int)pargs->arg1);
+} /*syscall_semV*/
+
+/*
+ * V on the semaphore with the given ID, for the syscall and for the
+ * phase 4 drivers. Returns 0, or -1 if there is no such semaphore.
+ */
+int semv_real(int semID)
+{
     int slot = getSemSlot(semID);
 
     // check for bad input
-    if (semTable[slot].status == 0 || semID < 0)
+    if (semID < 0 || semTable[slot].status == 0)
     {
-        pargs->arg4 = -1;
-        return;
+        return -1;
     }
 
-    semTable[slot].value = semTable[slot].value + 1;
-
-    // keep data from corruption
-    MboxSend(mutexBox, NULL, 0);
+    disableInterrupts();
 
     if (semTable[slot].firstWaiting != NULL)
     {
-        user_proc_ptr curFirst = semTable[slot].firstWaiting;
-        // advance the waiting list
-        semTable[slot].firstWaiting = semTable[slot].firstWaiting->nextWaiting;
-        MboxCondSend(curFirst->semMbox, NULL, 0);
+        // the woken proc consumes this V, so value stays the same
+        unblock_proc(removeFromWaitList(slot)->waitingPid);
     }
+    else
+    {
+        semTable[slot].value++;
+    }
+    TRACE(TRACE_SEM_V, semID, semTable[slot].value);
 
-    MboxReceive(mutexBox, NULL, 0);
-    pargs->arg4 = 0;
-
-} /*syscall_semV*/
+    enableInterrupts();
+    return 0;
+} /*semv_real*/
 
 /*
- * Frees a semaphore
+ * Frees a semaphore. Procs blocked on it are woken and their semP
+ * returns -1.
  */
 void syscall_semFree(sysargs *pargs)
 {
@@ -357,25 +490,22 @@ void syscall_semFree(sysargs *pargs)
     int slot = getSemSlot(semID);
 
     // check for bad input
-    if (semTable[slot].status == 0 || semID < 0)
+    if (semID < 0 || semTable[slot].status == 0)
     {
         pargs->arg4 = -1;
         return;
     }
 
+    disableInterrupts();
+
     if (semTable[slot].firstWaiting != NULL)
     {
-        user_proc_ptr cur = semTable[slot].firstWaiting;
-        user_proc_ptr temp;
-
-        // zap all waiting processes
-        while (cur != NULL)
+        // wake all waiting processes, marked so they know it's gone
+        while (semTable[slot].firstWaiting != NULL)
         {
-            zap(cur->pid);
-            temp = cur;
-            cur = cur->nextChild;
-            /* Possibly clear proc entry*/
-            // memset(temp, 0, sizeof(userProcTable[0]));
+            user_proc_ptr waiter = removeFromWaitList(slot);
+            waiter->semFreed = 1;
+            unblock_proc(waiter->waitingPid);
         }
 
         pargs->arg4 = 1;
@@ -388,8 +518,11 @@ void syscall_semFree(sysargs *pargs)
     semTable[slot].value = 0;
     semTable[slot].status = 0;
     semTable[slot].firstWaiting = NULL;
+    semTable[slot].lastWaiting = NULL;
     numSems--;
 
+    enableInterrupts();
+
 } /* syscall_semFree*/
 
 /*
@@ -397,11 +530,18 @@ void syscall_semFree(sysargs *pargs)
  */
 void syscall_getTimeofDay(sysargs *pargs)
 {
-    int time = sys_clock();
+    int time;
+    gettimeofday_real(&time);
     pargs->arg1 = time;
 
 } /* syscall_getTimeofDay*/
 
+/* Stores the time-of-day clock in *time */
+void gettimeofday_real(int *time)
+{
+    *time = sys_clock();
+} /* gettimeofday_real*/
+
 /*
  * Returns	the	CPU	time	of	the	process	(this	is	the	actual	CPU	time	used,
  * not	just	the	time	since
@@ -419,16 +559,38 @@ void syscall_cpuTime(sysargs *pargs)
  */
 void syscall_getPID(sysargs *pargs)
 {
-    int curPID = getpid();
+    int curPID;
+    getPID_real(&curPID);
     pargs->arg1 = curPID;
 
 } /* syscall_getPID*/
 
+/* Stores the pid of the running process in *pid */
+void getPID_real(int *pid)
+{
+    *pid = getpid();
+} /* getPID_real*/
+
+/*
+ * The syscall vector points to this function for GetProcStats.
+ * Copies the accounting of the proc whose pid is in arg1 into the
+ * procStats that arg2 points to. arg4 is 0, or -1 if there is no
+ * such proc.
+ */
+void syscall_getProcStats(sysargs *pargs)
+{
+    int pid = (int)pargs->arg1;
+    procStats *stats = pargs->arg2;
+
+    pargs->arg4 = get_proc_stats(pid, stats);
+
+} /* syscall_getProcStats*/
+
 /*
  * Checks if process is in kernel mode. Does nothing if it is, prints
  * an error and halts if the process is not in kernel mode.
  */
-void check_kernel_mode()
+static void check_kernel_mode()
 {
     if ((PSR_CURRENT_MODE & psr_get()) == 0)
     {
@@ -441,7 +603,7 @@ void check_kernel_mode()
  * The sys call handler. The syscall interrupt points to this method
  * The correct syscall is then carried out as long as the value is valid
  */
-void syscall_handler(int dev, void *unit)
+static void syscall_handler(int dev, void *unit)
 {
     sysargs *sys_ptr;
     sys_ptr = (sysargs *)unit;
@@ -457,28 +619,21 @@ void syscall_handler(int dev, void *unit)
     {
         sys_vec[callNumber](sys_ptr);
     }
+    check_preempt(); // the call may have readied a proc outranking the caller
 } /*syscall_handler*/
 
-/* Adds a child to a user process' child linked list */
+/* Adds a child to the front of a user process' child linked list */
 void addToChildList(int parentSlot, int childSlot)
 {
-    // add as first child
-    if (userProcTable[parentSlot].firstChild == NULL)
-    {
-        userProcTable[parentSlot].firstChild = &userProcTable[childSlot];
-    }
-    else
-    {
-        user_proc_ptr cur = userProcTable[parentSlot].firstChild;
-        while (cur->nextChild != NULL)
-        {
-            // advance till nextChild is null
-            cur = cur->nextChild;
-        }
+    user_proc_ptr child = &userProcTable[childSlot];
 
-        // add the child to the list
-        cur->nextChild = &userProcTable[childSlot];
+    child->prevChild = NULL;
+    child->nextChild = userProcTable[parentSlot].firstChild;
+    if (child->nextChild != NULL)
+    {
+        child->nextChild->prevChild = child;
     }
+    userProcTable[parentSlot].firstChild = child;
 } /*addToChildList*/
 
 /*
@@ -488,33 +643,19 @@ void addToChildList(int parentSlot, int childSlot)
 void removeChild(int childPid)
 {
     int childSlot = childPid % MAXPROC;
-    int parentSlot = userProcTable[childSlot].parentPid % MAXPROC;
+    user_proc_ptr child = &userProcTable[childSlot];
+    int parentSlot = child->parentPid % MAXPROC;
 
-    // theres no child to remove
-    if (userProcTable[parentSlot].firstChild == NULL)
-    {
-        return;
-    }
-    else if (userProcTable[parentSlot].firstChild->pid == childPid)
-    {
-        // if child with given pid is first child, remove it from list and advance to next
-        userProcTable[parentSlot].firstChild = userProcTable[parentSlot].firstChild->nextChild;
-    }
-    else
-    {
-        user_proc_ptr cur = userProcTable[parentSlot].firstChild;
-        // find child with the given pid, remove it from the list
-        while (cur->nextChild != NULL)
-        {
-            if (cur->nextChild->pid == childPid)
-            {
-                cur->nextChild = cur->nextChild->nextChild;
-                return;
-            }
+    if (child->prevChild != NULL)
+        child->prevChild->nextChild = child->nextChild;
+    else if (userProcTable[parentSlot].firstChild == child)
+        userProcTable[parentSlot].firstChild = child->nextChild;
 
-            cur = cur->nextChild;
-        }
-    }
+    if (child->nextChild != NULL)
+        child->nextChild->prevChild = child->prevChild;
+
+    child->nextChild = NULL;
+    child->prevChild = NULL;
 } /*removeChild*/
 
 /*Sets to kernel mode*/
@@ -563,27 +704,93 @@ int getSemSlot(int semID)
 /*
  * Adds a process to the waiting list. The semSlot is the
  * slot of the semaphore in the semTable which has
- * the process waiting on it. The proc slot is the slot of
- * the user proc in the user proc table that is waiting.
+ * the process waiting on it. The pid is the process that
+ * is waiting, it is kept in the node because the pid field
+ * of the table entry is only filled in for spawned procs.
  */
-void addToWaitList(int semSlot, int procSlot)
+void addToWaitList(int semSlot, int pid)
 {
+    user_proc_ptr theProc = &userProcTable[pid % MAXPROC];
 
-    if (semTable[semSlot].firstWaiting == NULL)
+    theProc->nextWaiting = NULL;
+    theProc->waitingPid = pid;
+    if (semTable[semSlot].lastWaiting == NULL)
     {
-        semTable[semSlot].firstWaiting = &userProcTable[procSlot];
+        semTable[semSlot].firstWaiting = theProc;
     }
     else
     {
-        user_proc_ptr cur = semTable[semSlot].firstWaiting;
-
-        // advance till end of the list
-        while (cur->nextWaiting != NULL)
-        {
-            cur = cur->nextWaiting;
-        }
-
         // add to end of the list
-        cur->nextWaiting = &userProcTable[procSlot];
+        semTable[semSlot].lastWaiting->nextWaiting = theProc;
     }
+    semTable[semSlot].lastWaiting = theProc;
 } /* addToWaitList*/
+
+/*
+ * Removes and returns the first process waiting on the semaphore
+ * in the given slot of the semTable.
+ */
+user_proc_ptr removeFromWaitList(int semSlot)
+{
+    user_proc_ptr first = semTable[semSlot].firstWaiting;
+
+    // advance the waiting list
+    semTable[semSlot].firstWaiting = first->nextWaiting;
+    if (semTable[semSlot].firstWaiting == NULL)
+    {
+        semTable[semSlot].lastWaiting = NULL;
+    }
+    first->nextWaiting = NULL;
+
+    return first;
+} /* removeFromWaitList*/
+
+/*
+ * Returns 1 if the proc with the given pid is on the waiting list of
+ * the semaphore in the given slot, 0 if not.
+ */
+static int isWaiting(int semSlot, int pid)
+{
+    user_proc_ptr cur = semTable[semSlot].firstWaiting;
+
+    while (cur != NULL && cur != &userProcTable[pid % MAXPROC])
+    {
+        cur = cur->nextWaiting;
+    }
+    return cur != NULL;
+} /* isWaiting*/
+
+/*
+ * Takes the proc with the given pid off the waiting list of the
+ * semaphore in the given slot, if it is on it.
+ */
+static void leaveWaitList(int semSlot, int pid)
+{
+    user_proc_ptr theProc = &userProcTable[pid % MAXPROC];
+    user_proc_ptr prev = NULL;
+    user_proc_ptr cur = semTable[semSlot].firstWaiting;
+
+    while (cur != NULL && cur != theProc)
+    {
+        prev = cur;
+        cur = cur->nextWaiting;
+    }
+    if (cur == NULL)
+    {
+        return;
+    }
+
+    if (prev == NULL)
+    {
+        semTable[semSlot].firstWaiting = cur->nextWaiting;
+    }
+    else
+    {
+        prev->nextWaiting = cur->nextWaiting;
+    }
+    if (semTable[semSlot].lastWaiting == cur)
+    {
+        semTable[semSlot].lastWaiting = prev;
+    }
+    cur->nextWaiting = NULL;
+} /* leaveWaitList*/
@@ -0,0 +1,70 @@
+/* ------------------------------------------------------------------------
+   trace.h
+
+   Kernel tracepoints. Every phase records fixed size binary events into
+   one ring buffer kept by phase 1. finish() writes the buffer to the file
+   named by the USLOSS_TRACE environment variable, and trace2json turns
+   that file into Chrome trace JSON on the host.
+
+   Only plain C types are used here so trace2json can include it too.
+   ------------------------------------------------------------------------ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#define TRACE_RECORDS 4096 // ring size, must be a power of 2
+#define TRACE_MAGIC 0x52545355 // "USTR"
+#define TRACE_VERSION 1
+
+/* Event ids, arg1 and arg2 are listed for each */
+#define TRACE_SWITCH 1        // old pid, new pid
+#define TRACE_FORK 2          // child pid, priority
+#define TRACE_QUIT 3          // quit code, parent pid
+#define TRACE_JOIN 4          // joined child pid, quit code
+#define TRACE_BLOCK 5         // block status, 0
+#define TRACE_UNBLOCK 6       // unblocked pid, 0
+#define TRACE_MBOX_SEND 7     // mbox id, msg size
+#define TRACE_MBOX_RECEIVE 8  // mbox id, msg size
+#define TRACE_MBOX_BLOCK 9    // mbox id, 0 for send 1 for receive
+#define TRACE_SEM_P 10        // sem handle, count after P
+#define TRACE_SEM_V 11        // sem handle, count after V
+#define TRACE_DISK_ENQUEUE 12 // unit, track
+#define TRACE_DISK_DISPATCH 13 // unit, track
+#define TRACE_DISK_COMPLETE 14 // unit, status
+#define TRACE_NUM_EVENTS 15
+
+typedef struct traceRecord traceRecord;
+typedef struct traceHeader traceHeader;
+
+/* One event, 16 bytes */
+struct traceRecord
+{
+   unsigned int timestamp; // sys_clock() when the event happened
+   unsigned short event;   // one of the TRACE_ ids
+   unsigned short pid;     // proc that was running
+   int arg1;
+   int arg2;
+};
+
+/* Start of a dump file, followed by numRecords records oldest first */
+struct traceHeader
+{
+   unsigned int magic;
+   unsigned int version;
+   unsigned int recordSize;
+   unsigned int numRecords;
+   unsigned int dropped; // records overwritten before the dump
+};
+
+extern int traceEnabled;
+extern void trace_record(int event, int arg1, int arg2);
+extern int trace_dump(char *path);
+
+/* Cheap enough to leave in, a flag check when tracing is off */
+#define TRACE(event, arg1, arg2)                \
+   do                                           \
+   {                                            \
+      if (traceEnabled)                         \
+         trace_record((event), (arg1), (arg2)); \
+   } while (0)
+
+#endif
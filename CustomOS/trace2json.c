@@ -0,0 +1,85 @@
+/* ------------------------------------------------------------------------
+   trace2json.c
+
+   Host tool, not part of the kernel. Converts a trace dump written by
+   finish() into Chrome trace JSON for chrome://tracing or Perfetto.
+
+   Build: cc -o trace2json trace2json.c
+   Usage: trace2json trace.bin > trace.json
+
+   Each proc is shown as its own thread. Context switches become run
+   slices, every other event is an instant event on the proc that was
+   running when it happened.
+   ------------------------------------------------------------------------ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "trace.h"
+
+static const char *eventNames[TRACE_NUM_EVENTS] = {
+    "unknown", "switch", "fork", "quit", "join", "block", "unblock",
+    "mbox_send", "mbox_receive", "mbox_block", "sem_p", "sem_v",
+    "disk_enqueue", "disk_dispatch", "disk_complete"};
+
+static void printEvent(traceRecord *rec, int *first)
+{
+    printf("%s\n", *first ? "" : ",");
+    *first = 0;
+
+    if (rec->event == TRACE_SWITCH)
+    {
+        printf("{\"name\":\"run\",\"ph\":\"E\",\"ts\":%u,\"pid\":0,\"tid\":%d},\n",
+               rec->timestamp, rec->arg1);
+        printf("{\"name\":\"run\",\"ph\":\"B\",\"ts\":%u,\"pid\":0,\"tid\":%d}",
+               rec->timestamp, rec->arg2);
+        return;
+    }
+
+    printf("{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%u,\"pid\":0,\"tid\":%u,"
+           "\"args\":{\"arg1\":%d,\"arg2\":%d}}",
+           rec->event < TRACE_NUM_EVENTS ? eventNames[rec->event] : "unknown",
+           rec->timestamp, rec->pid, rec->arg1, rec->arg2);
+}
+
+int main(int argc, char *argv[])
+{
+    traceHeader header;
+    traceRecord rec;
+    int first = 1;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s trace.bin\n", argv[0]);
+        return 1;
+    }
+
+    FILE *in = fopen(argv[1], "rb");
+    if (in == NULL)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    if (fread(&header, sizeof(header), 1, in) != 1 || header.magic != TRACE_MAGIC ||
+        header.version != TRACE_VERSION || header.recordSize != sizeof(traceRecord))
+    {
+        fprintf(stderr, "%s: not a trace dump from this kernel\n", argv[1]);
+        fclose(in);
+        return 1;
+    }
+
+    if (header.dropped > 0)
+    {
+        fprintf(stderr, "%s: %u older records were overwritten\n", argv[1], header.dropped);
+    }
+
+    printf("{\"traceEvents\":[");
+    for (unsigned int i = 0; i < header.numRecords && fread(&rec, sizeof(rec), 1, in) == 1; i++)
+    {
+        printEvent(&rec, &first);
+    }
+    printf("\n]}\n");
+
+    fclose(in);
+    return 0;
+}